@@ -0,0 +1,372 @@
+#include "asterisk.h"
+
+/* based on bridges/bridge_simple.c */
+
+#include <string.h>                     /* for memcpy, memmove, memset */
+
+#include "asterisk/bridge.h"            /* for ast_bridge, etc */
+#include "asterisk/bridge_channel.h"    /* for ast_bridge_channel, etc */
+#include "asterisk/bridge_technology.h" /* for ast_bridge_technology, etc */
+#include "asterisk/channel.h"           /* for ast_channel_rawwriteformat, etc */
+#include "asterisk/format.h"            /* for ast_format_get_attribute_data */
+#include "asterisk/format_cache.h"      /* for ast_format_evs */
+#include "asterisk/frame.h"             /* for ast_frame, etc */
+#include "asterisk/linkedlists.h"       /* for AST_LIST_TRAVERSE, etc */
+#include "asterisk/logger.h"            /* for ast_log, ast_debug, etc */
+#include "asterisk/module.h"
+#include "asterisk/utils.h"             /* for ARRAY_LEN, MIN, MAX */
+
+#include "asterisk/evs.h"               /* for evs_parse_payload, etc */
+
+/*
+ * Repacketizer between two EVS call legs with different framing. The
+ * core builds no translation path within one codec, and evs_cmp reports
+ * such legs as equal, so a native or simple bridge would pass their
+ * payloads as they are. This technology is chosen instead, but only when
+ * the framing of the legs differs, see evs_bridge_compatible. Frames are
+ * queued as they arrive and sent as the other leg negotiated: Header-Full
+ * or Compact format, with or without CMR, and as many frames per payload
+ * as its ptime. The frames themselves are not changed, never decoded.
+ */
+#define EVS_SAMPLES        320              /* 20 ms at 16 kHz */
+#define EVS_FRAME_BYTES    (2560 / 8)       /* 128 kbps */
+#define REPACK_MAX_FRAMES  (2 * EVS_MAX_FRAMES)
+#define AMRWB_IO_1265      2                /* mode indication */
+#define AMRWB_IO_SID       9
+
+/* One per leg, for the frames which that leg sends */
+struct evs_repack {
+	unsigned char request;              /* CMR to forward; EVS_NO_REQ if none */
+	unsigned char mode_indication;      /* of the last AMR-WB IO speech frame */
+	int count;                          /* frames queued */
+	unsigned char toc[REPACK_MAX_FRAMES];
+	unsigned char data[REPACK_MAX_FRAMES][EVS_FRAME_BYTES];
+	/* CMR, ToCs, frames, and padding of one payload */
+	unsigned char out[1 + EVS_MAX_FRAMES * (1 + EVS_FRAME_BYTES) + 1];
+};
+
+/* Framing of one direction, as negotiated by the receiving leg */
+struct evs_framing {
+	int hf_only;
+	int cmr;
+	int frames_per_packet;
+};
+
+static void evs_framing_get(struct ast_format *format, struct evs_framing *framing)
+{
+	struct evs_attr *attr = ast_format_get_attribute_data(format);
+	unsigned int ptime = 20;
+
+	/* As in codec_evs.c:evs_frames_per_packet; without a ptime, one frame */
+	if (attr && attr->ptime) {
+		ptime = attr->ptime;
+	}
+	if (attr && attr->maxptime) {
+		ptime = MIN(ptime, attr->maxptime);
+	}
+
+	framing->hf_only = attr ? attr->hf_only : -1;
+	framing->cmr = attr ? attr->cmr : 0;
+	framing->frames_per_packet = MAX(1, MIN(ptime / 20, EVS_MAX_FRAMES));
+}
+
+static int evs_framing_differs(struct ast_format *src, struct ast_format *dst)
+{
+	struct evs_framing from;
+	struct evs_framing to;
+
+	evs_framing_get(src, &from);
+	evs_framing_get(dst, &to);
+
+	return (1 == from.hf_only) != (1 == to.hf_only) ||
+		from.cmr != to.cmr ||
+		from.frames_per_packet != to.frames_per_packet;
+}
+
+static int evs_format_is_evs(struct ast_format *format)
+{
+	return format && AST_FORMAT_CMP_NOT_EQUAL != ast_format_cmp(format, ast_format_evs);
+}
+
+/* data has to be cleared before */
+static void evs_put_bits(unsigned char *data, unsigned int *pos, unsigned int value, int count)
+{
+	while (0 < count--) {
+		data[*pos / 8] |= ((value >> count) & 1) << (7 - (*pos % 8));
+		*pos = *pos + 1;
+	}
+}
+
+static void evs_copy_bits(unsigned char *dst, unsigned int *dst_pos,
+	const unsigned char *src, unsigned int src_pos, int count)
+{
+	while (0 < count--) {
+		const unsigned int bit = (src[src_pos / 8] >> (7 - (src_pos % 8))) & 1;
+
+		evs_put_bits(dst, dst_pos, bit, 1);
+		src_pos = src_pos + 1;
+	}
+}
+
+static int evs_bridge_compatible(struct ast_bridge *bridge)
+{
+	struct ast_bridge_channel *c0 = AST_LIST_FIRST(&bridge->channels);
+	struct ast_bridge_channel *c1 = c0 ? AST_LIST_NEXT(c0, entry) : NULL;
+	struct ast_format *read0;
+	struct ast_format *write0;
+	struct ast_format *read1;
+	struct ast_format *write1;
+	int res = 0;
+
+	if (2 != bridge->num_channels || !c0 || !c1) {
+		return 0;
+	}
+
+	ast_channel_lock(c0->chan);
+	read0 = ao2_bump(ast_channel_rawreadformat(c0->chan));
+	write0 = ao2_bump(ast_channel_rawwriteformat(c0->chan));
+	ast_channel_unlock(c0->chan);
+	ast_channel_lock(c1->chan);
+	read1 = ao2_bump(ast_channel_rawreadformat(c1->chan));
+	write1 = ao2_bump(ast_channel_rawwriteformat(c1->chan));
+	ast_channel_unlock(c1->chan);
+
+	if (evs_format_is_evs(read0) && evs_format_is_evs(write0) &&
+		evs_format_is_evs(read1) && evs_format_is_evs(write1)) {
+		res = evs_framing_differs(read0, write1) || evs_framing_differs(read1, write0);
+	}
+
+	ao2_cleanup(read0);
+	ao2_cleanup(write0);
+	ao2_cleanup(read1);
+	ao2_cleanup(write1);
+
+	return res;
+}
+
+static int evs_bridge_join(struct ast_bridge *bridge, struct ast_bridge_channel *bridge_channel)
+{
+	struct ast_channel *c0 = AST_LIST_FIRST(&bridge->channels)->chan;
+	struct ast_channel *c1 = AST_LIST_LAST(&bridge->channels)->chan;
+	struct evs_repack *repack;
+
+	repack = ast_calloc(1, sizeof(*repack));
+	if (!repack) {
+		return -1;
+	}
+	repack->request = EVS_NO_REQ;
+	repack->mode_indication = AMRWB_IO_1265;
+	bridge_channel->tech_pvt = repack;
+
+	/*
+	 * If this is the first channel we can't make it compatible...
+	 * unless we make it compatible with itself.  O.o
+	 */
+	if (c0 == c1) {
+		return 0;
+	}
+
+	return ast_channel_make_compatible(c0, c1);
+}
+
+static void evs_bridge_leave(struct ast_bridge *bridge, struct ast_bridge_channel *bridge_channel)
+{
+	ast_free(bridge_channel->tech_pvt);
+	bridge_channel->tech_pvt = NULL;
+}
+
+/* Queues the frames of one payload; returns -1 if it is corrupted */
+static int evs_repack_in(struct evs_repack *repack, struct ast_frame *frame)
+{
+	struct evs_attr *attr = ast_format_get_attribute_data(frame->subclass.format);
+	struct evs_payload_frame frames[EVS_MAX_FRAMES];
+	unsigned char cmr;
+	int count;
+	int i;
+
+	count = evs_parse_payload(frame->data.ptr, frame->datalen, attr ? attr->hf_only : -1,
+		&cmr, frames, ARRAY_LEN(frames));
+	if (count < 0) {
+		ast_log(LOG_ERROR, "ToC does not match the payload; bitstream is corrupted\n");
+		return -1;
+	}
+	if (REPACK_MAX_FRAMES < repack->count + count) {
+		ast_log(LOG_WARNING, "Out of buffer space\n");
+		return -1;
+	}
+	if (EVS_NO_REQ != cmr) {
+		repack->request = cmr;
+	}
+
+	for (i = 0; i < count; i = i + 1) {
+		unsigned char *data = repack->data[repack->count];
+		const int bits = evs_toc_bits(frames[i].toc);
+		const unsigned char core_mode = frames[i].toc & EVS_FRAME_TYPE_MASK;
+		unsigned int pos = 0;
+
+		/* The ToC of the Header-Full format */
+		repack->toc[repack->count] = frames[i].toc & ~EVS_FOLLOWED_BIT;
+		if (0 == frames[i].offset) {
+			memcpy(data, frames[i].data, (bits + 7) / 8);
+		} else { /* Compact AMR-WB IO: after its CMR; SID lacks the mode indication */
+			memset(data, 0, (bits + 7) / 8);
+			if (AMRWB_IO_SID == core_mode) {
+				evs_copy_bits(data, &pos, frames[i].data, frames[i].offset, bits - 4);
+				evs_put_bits(data, &pos, repack->mode_indication, 4);
+			} else {
+				evs_copy_bits(data, &pos, frames[i].data, frames[i].offset, bits);
+			}
+		}
+		if ((frames[i].toc & EVS_MODE_BIT) && core_mode < AMRWB_IO_SID) {
+			repack->mode_indication = core_mode;
+		}
+		repack->count = repack->count + 1;
+	}
+
+	return 0;
+}
+
+/*
+ * Sends the queued frames in payloads as framed by the other leg. The
+ * payloads carry no timing information: one payload might be split, so
+ * the RTP stack derives the timestamps from the samples.
+ */
+static void evs_repack_out(struct evs_repack *repack, const struct evs_framing *framing,
+	struct ast_bridge *bridge, struct ast_bridge_channel *bridge_channel, struct ast_frame *frame)
+{
+	const int frames = framing->frames_per_packet;
+	int first = 0;
+
+	while (frames <= repack->count - first) {
+		struct ast_frame out = {
+			.frametype = AST_FRAME_VOICE,
+			.subclass.format = frame->subclass.format,
+			.src = "bridge_evs",
+			.data.ptr = repack->out,
+			.samples = frames * EVS_SAMPLES,
+			.len = frames * 20,
+		};
+		unsigned char *data = repack->out;
+		int amr_wb_io = 0;
+		int speech = 0;
+		int datalen;
+		int compact;
+		int cmr;
+		int i;
+
+		for (i = first; i < first + frames; i = i + 1) {
+			amr_wb_io |= (repack->toc[i] & EVS_MODE_BIT);
+			speech |= (0 < evs_toc_bits(repack->toc[i]));
+		}
+
+		/* Same rules as for the encoder, see codec_evs.c:lintoevs_frameout */
+		cmr = amr_wb_io || (-1 != framing->cmr && (1 == framing->cmr || EVS_NO_REQ != repack->request));
+		compact = (1 == frames && !cmr && 1 != framing->hf_only);
+
+		if (compact) {
+			datalen = 0;
+		} else {
+			if (cmr) {
+				data[0] = repack->request | EVS_HEADER_TYPE_BIT;
+			}
+			for (i = 0; i < frames; i = i + 1) {
+				data[cmr + i] = repack->toc[first + i];
+				if (i < frames - 1) {
+					data[cmr + i] |= EVS_FOLLOWED_BIT;
+				}
+			}
+			datalen = cmr + frames;
+		}
+		for (i = first; i < first + frames; i = i + 1) {
+			const int bytes = (evs_toc_bits(repack->toc[i]) + 7) / 8;
+
+			memcpy(data + datalen, repack->data[i], bytes);
+			datalen = datalen + bytes;
+		}
+		/* Header-Full with the size of a Compact payload gets padded,
+		 * see 3GPP TS 26.445 A.2.3.2 */
+		while (!compact && 1 != framing->hf_only && 0 <= evs_compact_toc(datalen)) {
+			data[datalen] = 0x00;
+			datalen = datalen + 1;
+		}
+
+		first = first + frames;
+		if (!speech) {
+			continue; /* nothing but NO_DATA, nothing to send */
+		}
+		repack->request = EVS_NO_REQ;
+
+		out.datalen = datalen;
+		ast_bridge_queue_everyone_else(bridge, bridge_channel, &out);
+	}
+
+	/* Move the remaining frames to the front */
+	if (first) {
+		repack->count = repack->count - first;
+		memmove(repack->toc, repack->toc + first, repack->count);
+		memmove(repack->data, repack->data + first, repack->count * sizeof(repack->data[0]));
+	}
+}
+
+static int evs_bridge_write(struct ast_bridge *bridge, struct ast_bridge_channel *bridge_channel, struct ast_frame *frame)
+{
+	struct ast_bridge_channel *other;
+	struct ast_format *format = NULL;
+	struct evs_framing framing;
+	struct evs_repack *repack;
+
+	if (!bridge_channel || AST_FRAME_VOICE != frame->frametype ||
+		!evs_format_is_evs(frame->subclass.format) || 0 == frame->datalen) {
+		return ast_bridge_queue_everyone_else(bridge, bridge_channel, frame);
+	}
+	repack = bridge_channel->tech_pvt;
+
+	AST_LIST_TRAVERSE(&bridge->channels, other, entry) {
+		if (other != bridge_channel) {
+			ast_channel_lock(other->chan);
+			format = ao2_bump(ast_channel_rawwriteformat(other->chan));
+			ast_channel_unlock(other->chan);
+			break;
+		}
+	}
+	if (!repack || !evs_format_is_evs(format)) {
+		ao2_cleanup(format);
+		return ast_bridge_queue_everyone_else(bridge, bridge_channel, frame);
+	}
+	evs_framing_get(format, &framing);
+	ao2_ref(format, -1);
+
+	if (0 == evs_repack_in(repack, frame)) {
+		evs_repack_out(repack, &framing, bridge, bridge_channel, frame);
+	}
+
+	return 0;
+}
+
+static struct ast_bridge_technology evs_bridge = {
+	.name = "evs_repack",
+	.capabilities = AST_BRIDGE_CAPABILITY_1TO1MIX,
+	/* above native RTP, which would pass the payloads as they are */
+	.preference = AST_BRIDGE_PREFERENCE_BASE_NATIVE + 1,
+	.join = evs_bridge_join,
+	.leave = evs_bridge_leave,
+	.compatible = evs_bridge_compatible,
+	.write = evs_bridge_write,
+};
+
+static int unload_module(void)
+{
+	ast_bridge_technology_unregister(&evs_bridge);
+	return 0;
+}
+
+static int load_module(void)
+{
+	if (ast_bridge_technology_register(&evs_bridge)) {
+		unload_module();
+		return AST_MODULE_LOAD_DECLINE;
+	}
+	return AST_MODULE_LOAD_SUCCESS;
+}
+
+AST_MODULE_INFO_STANDARD(ASTERISK_GPL_KEY, "3GPP EVS Repacketizing Bridge Module");
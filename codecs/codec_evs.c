@@ -2,17 +2,72 @@
 	<depend>evs</depend>
 ***/
 
+/*** DOCUMENTATION
+	<manager name="EVSShowStats" language="en_US">
+		<synopsis>
+			Show the statistics of the 3GPP EVS transcoding module.
+		</synopsis>
+		<syntax>
+			<xi:include xpointer="xpointer(/docs/manager[@name='Login']/syntax/parameter[@name='ActionID'])" />
+		</syntax>
+		<description>
+			<para>Counters of all encoders and decoders since the module was
+			loaded, as in <literal>evs show stats</literal>.</para>
+		</description>
+	</manager>
+	<managerEvent language="en_US" name="EVSSummary">
+		<managerEventInstance class="EVENT_FLAG_REPORTING">
+			<synopsis>Raised when an EVS encoder or decoder of a call ends, after it processed payloads.</synopsis>
+			<syntax>
+				<parameter name="Translator"/>
+				<parameter name="SampleRate"/>
+				<parameter name="Frames"><para>Encoded, decoded, or concealed.</para></parameter>
+				<parameter name="DTX"><para>Frames of SID or NO_DATA.</para></parameter>
+				<parameter name="CMR"><para>Sent, or received with a request.</para></parameter>
+				<parameter name="Concealed"><para>Decoders only.</para></parameter>
+				<parameter name="Corrupt"><para>Payloads dropped.</para></parameter>
+				<parameter name="AvgTime"><para>ns per frame.</para></parameter>
+				<parameter name="State"><para>Bytes of memory.</para></parameter>
+				<parameter name="Modes"><para>Frames per mode, from the ToC.</para></parameter>
+			</syntax>
+			<description>
+				<para>Asterisk does not tell a translator its channel; therefore,
+				the event is raised per translator, not per channel. A channel
+				might use several translators during its call, and an encoder
+				shared by a group of calls reports once for the whole group.</para>
+			</description>
+		</managerEventInstance>
+	</managerEvent>
+***/
+
 #include "asterisk.h"
 
-#include <math.h>                       /* for log10, floor */
+#include <math.h>                       /* for log10, floor, floorf */
+#include <sched.h>                      /* for CPU_SET, cpu_set_t */
+#include <time.h>                       /* for clock_gettime */
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>                  /* for _mm_cvttps_epi32, etc */
+#elif defined(__aarch64__) && defined(__ARM_NEON)
+#include <arm_neon.h>                   /* for vrndmq_f32, etc */
+#endif
 
 #include "asterisk/astobj2.h"           /* for ao2_ref */
+#include "asterisk/cli.h"               /* for ast_cli, ast_cli_entry, etc */
 #include "asterisk/codec.h"             /* for AST_MEDIA_TYPE_AUDIO */
+#include "asterisk/config.h"            /* for ast_config_load, etc */
+#include "asterisk/format_cache.h"      /* for ast_format_evs, etc */
 #include "asterisk/frame.h"             /* for ast_frame, etc */
 #include "asterisk/linkedlists.h"       /* for AST_LIST_NEXT, etc */
+#include "asterisk/lock.h"              /* for ast_mutex_lock, etc */
 #include "asterisk/logger.h"            /* for ast_log, ast_debug, etc */
+#include "asterisk/manager.h"           /* for manager_event, astman_append */
 #include "asterisk/module.h"
+#include "asterisk/rtp_engine.h"        /* for ast_rtp_rtcp_report, etc */
+#include "asterisk/strings.h"           /* for ast_true */
+#include "asterisk/test.h"              /* for AST_TEST_DEFINE, etc */
+#include "asterisk/time.h"              /* for ast_tvnow, ast_tvdiff_ms */
 #include "asterisk/translate.h"         /* for ast_trans_pvt, etc */
+#include "asterisk/utils.h"             /* for ARRAY_LEN, MIN, MAX, etc */
 
 #include "asterisk/evs.h"               /* for evs_attr */
 
@@ -22,11 +77,29 @@
 #include <3gpp-evs/stat_com.h>          /* for FRAMEMODE_NORMAL */
 #include <3gpp-evs/typedef.h>           /* for UWord8, UWord16, Word16 */
 #include <3gpp-evs/mime.h>              /* for AMRWB_IOmode2rate, etc */
+#include <3gpp-evs/evs_rx.h>            /* for EVS_RX_Open, etc */
 /* mime.h must come last because typedef.h (Word16, Word32) missing */
 
-#define BUFFER_SAMPLES 5760
-#define BUFFER_BYTES   (MAX_BITS_PER_FRAME + 7) / 8
+#define BUFFER_BYTES   ((MAX_BITS_PER_FRAME + 7) / 8)
+#define AMRWB_IO_MAX_BITS 477 /* 23.85 */
 #define	EVS_SAMPLES    320
+#define CACHE_LINE     64
+
+/* Samples of one 20 ms frame */
+#define FRAME_SAMPLES(rate) ((rate) / 50)
+/* Encoder input: rest of the last frame plus 100 ms incoming */
+#define ENCODER_BUFFER_SAMPLES(rate) ((rate) / 10)
+/* Decoder output: all frames of one compound payload (300 ms) */
+#define DECODER_BUFFER_SAMPLES(rate) ((rate) * 300 / 1000)
+/* Largest payload: CMR, then ToC and a 128 kbps frame for each frame */
+#define ENCODER_PAYLOAD_BYTES (1 + EVS_MAX_FRAMES * (1 + BUFFER_BYTES))
+
+#define ENCODER_DESC_SIZE(rate) (sizeof(struct evs_encoder_pvt) + CACHE_LINE - 1 + \
+	(ENCODER_BUFFER_SAMPLES(rate) + FRAME_SAMPLES(rate)) * sizeof(short))
+/* Encoder input older than this is not continued with, see lintoevs_framein */
+#define ENCODER_STALE_MS 100
+#define DECODER_DESC_SIZE(rate) (sizeof(struct evs_decoder_pvt) + CACHE_LINE - 1 + \
+	FRAME_SAMPLES(rate) * sizeof(float))
 
 /* Sample frame data */
 #include "asterisk/slin.h"
@@ -39,37 +112,252 @@
  */
 static struct ast_codec *evs_codec; /* codec of the cached format */
 static int (*evs_previous_sample_counter)(struct ast_frame *frame);
-static unsigned int evs_previous_maximum_ms;
 
-struct evs_coder_pvt {
+/*
+ * The buffers are sized by the sample rate of the translator, see
+ * ENCODER_DESC_SIZE and DECODER_DESC_SIZE. They start at the next cache
+ * line within data, see lintoevs_new and evstolin_new.
+ */
+/*
+ * Counters of a translator, written by the thread which runs it, and the
+ * same for the whole module, written atomically, see evs_stats_time.
+ */
+#define STATS_MODES  32                 /* ToC: EVS mode bit and frame type */
+#define STATS_TIMES  8                  /* see stats_time_limits */
+#define STATS_LOG_INTERVAL 10           /* s between messages, see evs_stats_corrupt */
+
+struct evs_stats {
+	unsigned int frames;                /* encoded, decoded, or concealed */
+	unsigned int modes[STATS_MODES];
+	unsigned int cmr;                   /* sent, or received with a request */
+	unsigned int concealed;
+	unsigned int corrupt;               /* payloads dropped */
+	unsigned int times[STATS_TIMES];    /* per frame */
+	unsigned long long ns;              /* all frames */
+	unsigned long state;                /* bytes; of all active in the module */
+	int internal;                       /* of a translator, see evs_stats_internal */
+};
+
+/* Steps of the rate control, ascending */
+struct evs_rate_step {
+	short mode;                         /* EVS primary mode */
+	short rf;                           /* Channel-Aware mode (CA) */
+};
+
+struct evs_rate_control {
+	struct evs_rate_step steps[2 * (PRIMARY_128000 - PRIMARY_7200 + 1)];
+	int count;                          /* 0 = off */
+	int current;
+	int good;                           /* consecutive good reports */
+	short rf_fec_offset;
+	short rf_fec_indicator;             /* 1 = HI */
+};
+
+/* Parameters of a pooled encoder state, see evs_encoder_config_set */
+struct evs_encoder_config {
+	int input_Fs;
+	short Opt_DTX_ON;
+	short Opt_AMR_WB;
+	short Opt_RF_ON;
+	short rf_fec_offset;
+	short Opt_SC_VBR;
+	short max_bwidth;
+	long total_brate;
+};
+
+/* Encoders which give the same output for the same input */
+struct evs_shared_key {
+	struct evs_encoder_config config;
+	int frames_per_packet;
+	int cmr;                            /* attribute */
+	int hf_only;                        /* attribute */
+	int mode;                           /* as requested via CMR */
+};
+
+struct evs_encoder_pvt {
 	Encoder_State *encoder;
+	struct evs_rate_control rc;         /* RTCP feedback */
+	struct evs_mailbox *mailbox;        /* CMR from the decoder */
+	int mode;                           /* as requested via CMR */
+	/* Compound payload, assembled in outbuf */
+	int frames_per_packet;              /* from ptime */
+	int frames;                         /* frames in the current payload */
+	int speech;                         /* frames other than NO_DATA */
+	int cmr;                            /* CMR byte present */
+	int compact;                        /* Compact format: no ToC */
+	int datalen;                        /* bytes in the current payload */
+	/* Input: a ring buffer, unless read from the incoming frame */
+	short *buf;                         /* ENCODER_BUFFER_SAMPLES */
+	short *window;                      /* FRAME_SAMPLES, across the end of buf */
+	int head;                           /* oldest sample in buf */
+	const short *direct;                /* incoming frame of whole 20 ms frames */
+	struct timeval last;                /* of the last incoming frame */
+	/* AMR-WB IO in Compact format, before its shift by the CMR */
+	unsigned char serial[(AMRWB_IO_MAX_BITS + 7) / 8 + 1];
+	struct evs_async *async;            /* NULL = synchronous */
+	/* Shared encoder, see codecs.conf [evs] shared_encoder */
+	int shareable;
+	struct evs_shared_key key;
+	struct evs_shared *shared;          /* of the last step */
+	unsigned int step;                  /* steps of that group so far */
+	int boundary;                       /* its payload complete, no samples left */
+	int step_silent;                    /* input of this step is all zero */
+	unsigned long long step_hash;       /* of the input of this step */
+	unsigned long long last_hash;       /* of the input of the last step */
+	struct evs_stats stats;
+	unsigned char data[];
+};
+
+struct evs_delayed_frame {
+	int silence;                        /* inserted, when the delay grew */
+	struct evs_payload_frame frame;     /* data is NULL, if lost */
+	unsigned char data[BUFFER_BYTES + 1];
+};
+
+struct evs_decoder_pvt {
 	Decoder_State *decoder;
-	short buf[BUFFER_SAMPLES];
-	float con[BUFFER_BYTES];
+	/* Packet-Loss Concealment (PLC) */
+	int seqno;                          /* expected next; -1 unknown */
+	int frames;                         /* in the last payload */
+	/* Channel-Aware mode (CA): frames held back for their partial copies */
+	struct evs_delayed_frame delayed[MAX_RF_FEC_OFFSET + 1];
+	int delay_depth;                    /* frames held back; 0 = off */
+	int delay_first;                    /* oldest in delayed */
+	int delay_count;
+	/* Jitter Buffer Management (JBM), see codecs.conf [evs] jbm */
+	EVS_RX_HANDLE jbm;
+	struct timeval jbm_start;
+	unsigned int jbm_time;              /* ms of playout, 20 per request */
+	unsigned int jbm_fed;               /* ms fed into the buffer */
+	unsigned long jbm_played;           /* samples played out */
+	unsigned int jbm_delay;             /* ms currently in the buffer */
+	short bandwidth;                    /* widest decoded, NB..FB; -1 none */
+	short bandwidth_recv;               /* widest of bw-recv, NB..FB; -1 unknown */
+	struct evs_async *async;            /* NULL = synchronous */
+	struct evs_stats stats;
+	struct timeval corrupt_logged;
+	float *con;                         /* FRAME_SAMPLES */
 	unsigned char fra[BUFFER_BYTES];
+	unsigned char data[];
+};
+
+/*
+ * Pool of initialized coder states. Creating a translator path requires
+ * a rather large Encoder_State/Decoder_State plus init_encoder/init_decoder.
+ * Instead of throwing that away when the path is destroyed, the state is
+ * reset and kept for the next path with the same parameters. The reset is
+ * done when a state is returned, therefore not during call setup.
+ */
+struct evs_encoder {
+	Encoder_State state; /* must be first, see evs_encoder_put */
+	struct evs_encoder_config config;
 	Indice ind_list[MAX_NUM_INDICES];
+	AST_LIST_ENTRY(evs_encoder) list;
+};
+
+struct evs_decoder {
+	Decoder_State state; /* must be first, see evs_decoder_put */
+	int output_Fs;
+	AST_LIST_ENTRY(evs_decoder) list;
 };
 
-static Word16 unpack_bit(UWord8 **pt, UWord8 *mask);
+/* Default values, see codecs.conf [evs] */
+#define DEFAULT_POOL_MAX     32
+#define DEFAULT_POOL_PREFILL 0
+#define DEFAULT_PTIME        20
+#define DEFAULT_JBM          0
+#define DEFAULT_RTCP_FEEDBACK 0
+#define DEFAULT_AMRWB_OCTET_ALIGN 0
+#define DEFAULT_ASYNC_WORKERS 0         /* synchronous */
+#define DEFAULT_SHARED_ENCODER 0
+#define DEFAULT_PREFER_16KHZ 0
+#define MAX_ASYNC_WORKERS    64
+
+/* Rate control, see lintoevs_feedback; fraction lost is in 1/256 */
+#define RC_LOSS_HIGH         13  /* 5%, step down */
+#define RC_LOSS_LOW          3   /* 1%, candidate to step up */
+#define RC_JITTER_HIGH       60  /* ms, step down */
+#define RC_JITTER_LOW        30  /* ms, candidate to step up */
+#define RC_RTT_HIGH          400 /* ms, step down */
+#define RC_GOOD_REPORTS      3   /* before a step up */
+
+/* Jitter Buffer Management (JBM) of the reference implementation */
+#define JBM_SAFETY_MARGIN    60 /* ms, see EVS_RX_Open */
+#define JBM_MAX_LEAD         60 /* ms played out ahead of the wall clock */
+
+/* Longer gaps are not concealed completely; the decoder fades out anyway */
+#define MAX_CONCEALED_FRAMES 10
+
+static unsigned int evs_pool_max = DEFAULT_POOL_MAX;
+static unsigned int evs_pool_prefill = DEFAULT_POOL_PREFILL;
+static unsigned int evs_ptime = DEFAULT_PTIME;
+static int evs_jbm = DEFAULT_JBM;
+static int evs_rtcp_feedback = DEFAULT_RTCP_FEEDBACK;
+static int evs_amrwb_octet_align = DEFAULT_AMRWB_OCTET_ALIGN;
+static unsigned int evs_async_workers = DEFAULT_ASYNC_WORKERS; /* on load only */
+static int evs_shared_encoder = DEFAULT_SHARED_ENCODER;
+static int evs_prefer_16khz = DEFAULT_PREFER_16KHZ; /* on load only */
+static int evs_amrwb_registered; /* only with an AMR-WB codec, see load_module */
+
+/* Offset of the partial copy, as in the D bits of a CMR */
+static const short rf_fec_offsets[4] = { 2, 3, 5, 7 };
+
+AST_MUTEX_DEFINE_STATIC(evs_pool_lock);
+static AST_LIST_HEAD_NOLOCK_STATIC(evs_encoder_pool, evs_encoder);
+static AST_LIST_HEAD_NOLOCK_STATIC(evs_decoder_pool, evs_decoder);
+/* all protected by evs_pool_lock */
+static unsigned int evs_encoder_pool_count;
+static unsigned int evs_decoder_pool_count;
+static unsigned int evs_encoder_pool_hits;
+static unsigned int evs_encoder_pool_misses;
+static unsigned int evs_decoder_pool_hits;
+static unsigned int evs_decoder_pool_misses;
+
+AST_MUTEX_DEFINE_STATIC(evs_jbm_lock);
+/* all protected by evs_jbm_lock */
+static unsigned int evs_jbm_sessions;
+static unsigned int evs_jbm_delay_total;    /* sum over all sessions, ms */
+
+/* Decoders, and those with a sample rate above their bandwidth, see
+ * evstolin_destroy: the core chooses the translator, and thereby the
+ * sample rate, before the first payload and by table costs only */
+static unsigned int evs_decoders_done;
+static unsigned int evs_decoders_oversampled;
+
+/* All translators, see struct evs_stats */
+static struct evs_stats evs_encoder_stats;
+static struct evs_stats evs_decoder_stats;
+static unsigned int evs_encoders_active;
+static unsigned int evs_decoders_active;
+
+/* Upper limits of the times per frame, in us */
+static const unsigned int stats_time_limits[STATS_TIMES - 1] = { 25, 50, 100, 200, 500, 1000, 2000 };
+static const char *const stats_time_names[STATS_TIMES] = {
+	"< 25 us", "< 50 us", "< 100 us", "< 200 us", "< 500 us", "< 1 ms", "< 2 ms", ">= 2 ms" };
+static const char *const stats_mode_names[STATS_MODES] = {
+	"2.8", "7.2", "8.0", "9.6", "13.2", "16.4", "24.4", "32", "48", "64", "96", "128",
+	"SID", "reserved", "LOST", "NO_DATA",
+	"AMR 6.6", "AMR 8.85", "AMR 12.65", "AMR 14.25", "AMR 15.85", "AMR 18.25",
+	"AMR 19.85", "AMR 23.05", "AMR 23.85", "AMR SID", "AMR 10", "AMR 11", "AMR 12",
+	"AMR 13", "AMR LOST", "AMR NO_DATA" };
+
 static Word16 rate2AMRWB_IOmode(Word32 rate);
 static Word16 rate2EVSmode(Word32 rate);
 static short select_mode(short Opt_AMR_WB, short Opt_RF_ON, long total_brate);
 static int select_bit_rate(int bit_rate, int max_bandwidth);
-
-/* Copy & Paste from lib_com/bitstream.c */
-static Word16 unpack_bit(UWord8 **pt, UWord8 *mask)
-{
-	Word16 bit = ((**pt & *mask) != 0);
-
-	*mask >>= 1;
-	if (*mask == 0)
-	{
-		*mask = 0x80;
-		(*pt)++;
-	}
-
-	return bit;
-}
+static void evs_encoder_config_set(struct evs_encoder_config *config,
+	const struct evs_attr *attr, unsigned int sample_rate);
+static void evs_encoder_init(struct evs_encoder *encoder);
+static Encoder_State *evs_encoder_get(const struct evs_encoder_config *config);
+static void evs_encoder_put(Encoder_State *state);
+static void evs_decoder_init(struct evs_decoder *decoder);
+static Decoder_State *evs_decoder_get(int output_Fs);
+static void evs_decoder_put(Decoder_State *state);
+static void evs_pool_trim(unsigned int max);
+static int lintoevs_new(struct ast_trans_pvt *pvt);
+static struct ast_frame *lintoevs_frameout(struct ast_trans_pvt *pvt);
+static void lintoevs_destroy(struct ast_trans_pvt *pvt);
+static void *cache_line_align(void *ptr);
 
 static Word16 rate2AMRWB_IOmode(Word32 rate)
 {
@@ -137,6 +425,105 @@ static Word16 rate2EVSmode(Word32 rate)
 	}
 }
 
+/*
+ * AMR payload is reordered on the wire, see lib_com/mime.h
+ * and lib_com/bitsream.c:read_indices_mime. Instead of one bit at a time,
+ * the bits are gathered in runs, built at load time from sort_ptr: bits
+ * which follow each other on the wire and in the decoder are one run, and
+ * each run is copied up to a byte at a time, see evs_amr_wb_gather. On
+ * send, indices_to_serial orders the bits already, see lintoevs_frameout.
+ */
+struct evs_amr_wb_run {
+	unsigned short dst;                 /* first bit in the decoder */
+	unsigned short src;                 /* first bit on the wire */
+	unsigned short bits;
+};
+
+static struct evs_amr_wb_run amr_wb_runs[AMRWB_IO_SID + 1][AMRWB_IO_MAX_BITS];
+static unsigned short amr_wb_run_count[AMRWB_IO_SID + 1];
+
+static void evs_amr_wb_tables_init(void)
+{
+	unsigned short to_codec[AMRWB_IO_MAX_BITS];
+	int mode;
+	int i;
+
+	for (mode = AMRWB_IO_6600; mode <= AMRWB_IO_SID; mode = mode + 1) {
+		const int num_bits = AMRWB_IOmode2rate[mode] / 50;
+		struct evs_amr_wb_run *run = NULL;
+
+		for (i = 0; i < num_bits; i = i + 1) {
+			to_codec[sort_ptr[mode][i]] = i;
+		}
+		amr_wb_run_count[mode] = 0;
+		for (i = 0; i < num_bits; i = i + 1) {
+			if (run && run->src + run->bits == to_codec[i]) {
+				run->bits = run->bits + 1;
+				continue;
+			}
+			run = &amr_wb_runs[mode][amr_wb_run_count[mode]];
+			run->dst = i;
+			run->src = to_codec[i];
+			run->bits = 1;
+			amr_wb_run_count[mode] = amr_wb_run_count[mode] + 1;
+		}
+	}
+}
+
+/* Writes num_bits of src, starting at its bit offset, in the order of the runs */
+static void evs_amr_wb_gather(unsigned char *dst, const unsigned char *src,
+	unsigned int offset, const struct evs_amr_wb_run *runs, unsigned int count,
+	unsigned int num_bits)
+{
+	unsigned int i;
+
+	memset(dst, 0, (num_bits + 7) / 8);
+	for (i = 0; i < count; i = i + 1) {
+		unsigned int d = runs[i].dst;
+		unsigned int s = offset + runs[i].src;
+		unsigned int n = runs[i].bits;
+
+		while (0 < n) {
+			/* up to the end of the byte in dst */
+			const unsigned int take = MIN(n, 8 - (d & 7));
+			unsigned int window = src[s >> 3] << 8;
+
+			if (8 < (s & 7) + take) {
+				window |= src[(s >> 3) + 1];
+			}
+			window = (window >> (16 - (s & 7) - take)) & ((1 << take) - 1);
+			dst[d >> 3] |= window << (8 - (d & 7) - take);
+
+			d = d + take;
+			s = s + take;
+			n = n - take;
+		}
+	}
+}
+
+/*
+ * From the order on the wire into the order of the decoder
+ * \retval STI bit of a Silence Insertion Description (SID) frame; otherwise 1
+ */
+static int evs_amr_wb_unsort(unsigned char *fra, const struct evs_payload_frame *frame,
+	unsigned int num_bits)
+{
+	const UWord16 core_mode = frame->toc & EVS_FRAME_TYPE_MASK;
+	/* skips the CMR in Compact */
+	const unsigned int sti = frame->offset + num_bits;
+
+	evs_amr_wb_gather(fra, frame->data, frame->offset, amr_wb_runs[core_mode],
+		amr_wb_run_count[core_mode], num_bits);
+
+	/* Auxiliary bits of Silence Insertion Description (SID) frame: STI,
+	 * followed by the mode indication (not in Compact), which is unused */
+	if (AMRWB_IO_SID == core_mode) {
+		return (frame->data[sti >> 3] >> (7 - (sti & 7))) & 1;
+	}
+
+	return 1; /* 0 = SID_FIRST; otherwise SID_UPDATE */
+}
+
 /* Copy & Paste from lib_enc/io_enc.c:io_ini_enc */
 static short select_mode(short Opt_AMR_WB, short Opt_RF_ON, long total_brate)
 {
@@ -189,593 +576,4493 @@ static int select_bit_rate(int bit_rate, int max_bandwidth)
 	}
 }
 
-static int lintoevs_new(struct ast_trans_pvt *pvt)
+static void *cache_line_align(void *ptr)
 {
-	struct evs_coder_pvt *apvt = pvt->pvt;
-	const unsigned int sample_rate = pvt->t->src_codec.sample_rate;
+	return (void *) (((uintptr_t) ptr + CACHE_LINE - 1) & ~((uintptr_t) CACHE_LINE - 1));
+}
 
-	struct evs_attr *attr = pvt->explicit_dst ?
-		ast_format_get_attribute_data(pvt->explicit_dst) : NULL;
-	const int channel_aware = attr ? MIN(attr->ch_aw_send, attr->ch_aw_recv) : -2;
-	const unsigned int dtx_on = attr ? MIN(attr->dtx, attr->dtx_send) : 0;
-	const int amr_wb = attr ? attr->evs_mode_switch : -1;
-	const int max_bandwidth = attr ? /* WB matches all bit-rates */
-		floor(log10(attr->bw_send) / log10(2)) - 1 : WB;
-	int bit_rate_evs = attr ? /* 16.4 is available in all bandwidths */
-		floor(log10(attr->br_send) / log10(2)) - 1 : PRIMARY_16400;
-	int bit_rate_amr;
+static long long evs_now_ns(void)
+{
+	struct timespec now;
 
-	apvt->encoder = ast_malloc(sizeof(*apvt->encoder));
-	if (NULL == apvt->encoder) {
-		ast_log(LOG_ERROR, "Error creating the 3GPP EVS encoder\n");
-		return -1;
-	}
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return now.tv_sec * 1000000000LL + now.tv_nsec;
+}
 
-	if (attr && 0 < attr->mode_set) {
-		bit_rate_amr = floor(log10(attr->mode_set) / log10(2));
-	} else {
-		bit_rate_amr = AMRWB_IO_2385;
-	}
+/* Increments a counter of a translator and the one of the module */
+static void evs_stats_count(unsigned int *counter, unsigned int *module)
+{
+	*counter = *counter + 1;
+	__atomic_add_fetch(module, 1, __ATOMIC_RELAXED);
+}
 
-	apvt->encoder->ind_list = apvt->ind_list;
-	apvt->encoder->input_Fs = sample_rate;
-	/* Value range:  0..2, see res/res_format_attr_evs.c */
-	apvt->encoder->Opt_DTX_ON = (0 < dtx_on);
-	apvt->encoder->var_SID_rate_flag = 1; /* Automatic interval */
-	/* Value range: -1..1, see res/res_format_attr_evs.c */
-	apvt->encoder->Opt_AMR_WB = (0 < amr_wb);
-	/* Value range: -2..7, see res/res_format_attr_evs.c */
-	apvt->encoder->Opt_RF_ON = (0 < channel_aware);
-	if (apvt->encoder->Opt_RF_ON) {
-		/* EVS library crashed with higher values */
-		apvt->encoder->rf_fec_offset = MIN(channel_aware, MAX_RF_FEC_OFFSET);
-	} else {
-		/* Must be set although it should follow Opt_RF_ON */
-		apvt->encoder->rf_fec_offset = 0;
-	}
-	apvt->encoder->rf_fec_indicator = 1; /* Frame-erasure-rate indicator = HI */
+/* Mode of a frame from its ToC */
+static void evs_stats_mode(struct evs_stats *stats, struct evs_stats *module, unsigned char toc)
+{
+	const int index = ((toc & EVS_MODE_BIT) ? 16 : 0) + (toc & EVS_FRAME_TYPE_MASK);
 
-	/* Variable bit-rate (SC-VBR) requires DTX according to the 3GPP EVS
-	 * library "lib_enc/io_enc.c:io_ini_enc" cases:
-	 * 1) st->Opt_SC_VBR && !st->Opt_DTX_ON
-	 * 2) st->total_brate == ACELP_5k90 */
-	apvt->encoder->Opt_SC_VBR = (0 == bit_rate_evs);
-	if (sample_rate <= 8000 || max_bandwidth == NB) {
-		apvt->encoder->max_bwidth = NB;
-	} else if (sample_rate <= 16000 || max_bandwidth == WB || apvt->encoder->Opt_SC_VBR) {
-		apvt->encoder->max_bwidth = WB;
-	} else if (sample_rate <= 32000 || max_bandwidth == SWB) {
-		apvt->encoder->max_bwidth = SWB;
-	} else {
-		apvt->encoder->max_bwidth = FB;
-	}
-	if (apvt->encoder->Opt_AMR_WB) {
-		apvt->encoder->total_brate = AMRWB_IOmode2rate[bit_rate_amr];
-	} else if (apvt->encoder->Opt_SC_VBR) {
-		apvt->encoder->total_brate = PRIMARYmode2rate[PRIMARY_7200];
-	} else {
-		bit_rate_evs = select_bit_rate(bit_rate_evs, apvt->encoder->max_bwidth);
-		apvt->encoder->total_brate = PRIMARYmode2rate[bit_rate_evs];
-	}
-	apvt->encoder->codec_mode = select_mode(apvt->encoder->Opt_AMR_WB,
-		apvt->encoder->Opt_RF_ON, apvt->encoder->total_brate);
-	apvt->encoder->last_codec_mode = apvt->encoder->codec_mode;
+	evs_stats_count(&stats->modes[index], &module->modes[index]);
+}
 
-	/* After setting the above parameters (some set other parameters) */
-	init_encoder(apvt->encoder);
+/* A frame was encoded, decoded, or concealed within ns */
+static void evs_stats_time(struct evs_stats *stats, struct evs_stats *module, long long ns)
+{
+	int i = 0;
 
-	if (attr) {
-		if (apvt->encoder->Opt_AMR_WB) {
-			attr->mode_current = 0x10 + bit_rate_amr;
-		} else if (apvt->encoder->max_bwidth ==  NB) {
-			attr->mode_current = 0x00 + bit_rate_evs;
-		} else if (apvt->encoder->max_bwidth ==  WB) {
-			attr->mode_current = 0x20 + bit_rate_evs;
-		} else if (apvt->encoder->max_bwidth == SWB) {
-			attr->mode_current = 0x30 + bit_rate_evs;
-		} else { /* FB */
-			attr->mode_current = 0x40 + bit_rate_evs;
-		}
+	while (i < STATS_TIMES - 1 && stats_time_limits[i] * 1000LL <= ns) {
+		i = i + 1;
 	}
+	evs_stats_count(&stats->frames, &module->frames);
+	evs_stats_count(&stats->times[i], &module->times[i]);
+	stats->ns = stats->ns + ns;
+	__atomic_add_fetch(&module->ns, ns, __ATOMIC_RELAXED);
+}
 
-	ast_debug(3, "Created encoder (3GPP EVS) with sample rate %d\n", sample_rate);
-	return 0;
+/* Memory of a translator: the core allocates desc_size and buf_size */
+static void evs_stats_state(struct ast_trans_pvt *pvt, struct evs_stats *stats,
+	struct evs_stats *module, size_t coder)
+{
+	stats->state = coder + sizeof(*pvt) + pvt->t->desc_size + pvt->t->buf_size;
+	__atomic_add_fetch(&module->state, stats->state, __ATOMIC_RELAXED);
 }
 
-static int evstolin_new(struct ast_trans_pvt *pvt)
+/* A payload is dropped; logged not more often than STATS_LOG_INTERVAL */
+static void evs_stats_corrupt(struct evs_stats *stats, struct timeval *logged, const char *reason)
 {
-	struct evs_coder_pvt *apvt = pvt->pvt;
-	const unsigned int sample_rate = pvt->t->dst_codec.sample_rate;
+	const struct timeval now = ast_tvnow();
 
-	apvt->decoder = ast_malloc(sizeof(*apvt->decoder));
-	if (NULL == apvt->decoder) {
-		ast_log(LOG_ERROR, "Error creating the 3GPP EVS decoder\n");
-		return -1;
+	evs_stats_count(&stats->corrupt, &evs_decoder_stats.corrupt);
+	if (1 == stats->corrupt || STATS_LOG_INTERVAL * 1000 <= ast_tvdiff_ms(now, *logged)) {
+		ast_log(LOG_ERROR, "%s; bitstream is corrupted (%u payloads so far)\n",
+			reason, stats->corrupt);
+		*logged = now;
 	}
+}
 
-	apvt->decoder->output_Fs = sample_rate;
-	init_decoder(apvt->decoder);
+/*
+ * No AMI event for the cost computation of the core, which feeds the
+ * sample frames of the translator; the benchmark and the tests mark their
+ * paths, see evs_path_internal
+ */
+static void evs_stats_internal(struct ast_trans_pvt *pvt, struct evs_stats *stats,
+	const struct ast_frame *f)
+{
+	const struct ast_frame *sample;
 
-	ast_debug(3, "Created decoder (3GPP EVS) with sample rate %d\n", sample_rate);
-	return 0;
+	if (stats->internal) {
+		return;
+	}
+	sample = pvt->t->sample ? pvt->t->sample() : NULL;
+	if (sample && sample->data.ptr == f->data.ptr) {
+		stats->internal = 1;
+	}
 }
 
-static int lintoevs_framein(struct ast_trans_pvt *pvt, struct ast_frame *f)
+/* SID and NO_DATA */
+static unsigned int evs_stats_dtx(const struct evs_stats *stats)
 {
-	struct evs_coder_pvt *apvt = pvt->pvt;
+	return stats->modes[PRIMARY_SID] + stats->modes[EVS_NO_DATA] +
+		stats->modes[16 + AMRWB_IO_SID] + stats->modes[16 + EVS_NO_DATA];
+}
+
+/* Modes as "13.2:250,SID:3" */
+static void evs_stats_modes(const struct evs_stats *stats, char *buf, size_t size)
+{
+	int i;
 
-	/* XXX We should look at how old the rest of our stream is, and if it
-	 is too old, then we should overwrite it entirely, otherwise we can
-	 get artifacts of earlier talk that do not belong */
-	memcpy(apvt->buf + pvt->samples, f->data.ptr, f->datalen);
-	pvt->samples += f->samples;
+	*buf = '\0';
+	for (i = 0; i < STATS_MODES && 1 < size; i = i + 1) {
+		const unsigned int count = __atomic_load_n(&stats->modes[i], __ATOMIC_RELAXED);
+		int length;
 
-	return 0;
+		if (0 == count) {
+			continue;
+		}
+		length = snprintf(buf, size, "%s%s:%u", (*buf ? "," : ""), stats_mode_names[i], count);
+		if (length < 0 || size <= length) {
+			break;
+		}
+		buf = buf + length;
+		size = size - length;
+	}
 }
 
-static struct ast_frame *lintoevs_frameout(struct ast_trans_pvt *pvt)
+/* End of a translator, usually of its call: AMI event EVSSummary */
+static void evs_stats_summary(struct ast_trans_pvt *pvt, const struct evs_stats *stats,
+	unsigned int sample_rate)
 {
-	struct evs_coder_pvt *apvt = pvt->pvt;
-	const unsigned int sample_rate = pvt->t->src_codec.sample_rate;
-	const unsigned int max_bandwidth = ((sample_rate / 8000) >> 1);
-	const short n_samples = sample_rate / 50;
-	struct ast_frame *result = NULL;
-	struct ast_frame *last = NULL;
-	int samples = 0; /* Output samples */
+	char modes[512];
+	char *current = modes;
+	char concealed[32] = "";
 
-	struct evs_attr *attr = ast_format_get_attribute_data(pvt->f.subclass.format);
-	const int mode = attr ? attr->mode_current :
-		((0x20 >> apvt->encoder->Opt_AMR_WB) + PRIMARY_16400); /* 0x20 is WB */
-	const int cmr = attr ? attr->cmr : 0;
-	const int bandwidth = (mode & 0x70);
-	unsigned int bit_rate = (mode & 0x0f);
+	/* No payload processed, or not of a call */
+	if ((0 == stats->frames && 0 == stats->corrupt) || stats->internal) {
+		return;
+	}
 
-	if (0x10 == bandwidth) {
-		apvt->encoder->Opt_AMR_WB = 1;
-		apvt->encoder->total_brate = AMRWB_IOmode2rate[bit_rate];
-	} else if (mode <= 0x7f) { /* 0xff = NO_REQ */
-		apvt->encoder->Opt_AMR_WB = 0;
-		apvt->encoder->total_brate = PRIMARYmode2rate[bit_rate];
-		apvt->encoder->Opt_SC_VBR = 0;
-		apvt->encoder->Opt_RF_ON = 0;
-		if (0x00 == bandwidth) {
-			apvt->encoder->max_bwidth = MIN(max_bandwidth,  NB);
-			if (0 == bit_rate) {
-				apvt->encoder->Opt_SC_VBR = 1;
-				apvt->encoder->total_brate = PRIMARYmode2rate[PRIMARY_7200];
-			}
-		} else if (0x20 == bandwidth) {
-			apvt->encoder->max_bwidth = MIN(max_bandwidth,  WB);
-			if (0 == bit_rate) {
-				apvt->encoder->Opt_SC_VBR = 1;
-				apvt->encoder->total_brate = PRIMARYmode2rate[PRIMARY_7200];
-			}
-		} else if (0x30 == bandwidth) {
-			apvt->encoder->max_bwidth = MIN(max_bandwidth, SWB);
-		} else if (0x40 == bandwidth) {
-			apvt->encoder->max_bwidth = MIN(max_bandwidth,  FB);
-		} else if (0x50 == bandwidth) {
-			apvt->encoder->Opt_RF_ON = 1;
-			apvt->encoder->total_brate = PRIMARYmode2rate[PRIMARY_13200];
-			apvt->encoder->max_bwidth = MIN(max_bandwidth,  WB);
-		} else if (0x60 == bandwidth) {
-			apvt->encoder->Opt_RF_ON = 1;
-			apvt->encoder->total_brate = PRIMARYmode2rate[PRIMARY_13200];
-			apvt->encoder->max_bwidth = MIN(max_bandwidth, SWB);
-		} /* else (0x70) is reserved; do nothing */
+	evs_stats_modes(stats, modes, sizeof(modes));
+	/* A payload without any frame, for example an immediate hangup */
+	if ('\0' == *current) {
+		current = "none";
+	}
+	/* Only a decoder conceals */
+	if (0 == strcmp(pvt->t->src_codec.name, "evs")) {
+		snprintf(concealed, sizeof(concealed), "Concealed: %u\r\n", stats->concealed);
 	}
-	apvt->encoder->codec_mode = select_mode(apvt->encoder->Opt_AMR_WB,
-		apvt->encoder->Opt_RF_ON, apvt->encoder->total_brate);
 
-	while (pvt->samples >= n_samples) {
-		struct ast_frame *current;
-		unsigned char *out = pvt->outbuf.uc;
-		const short *in = apvt->buf + samples;
-		int datalen = 0;
+	manager_event(EVENT_FLAG_REPORTING, "EVSSummary",
+		"Translator: %s\r\n"
+		"SampleRate: %u\r\n"
+		"Frames: %u\r\n"
+		"DTX: %u\r\n"
+		"CMR: %u\r\n"
+		"%s"
+		"Corrupt: %u\r\n"
+		"AvgTime: %llu\r\n"
+		"State: %lu\r\n"
+		"Modes: %s\r\n",
+		pvt->t->name, sample_rate, stats->frames, evs_stats_dtx(stats), stats->cmr,
+		concealed, stats->corrupt, stats->frames ? stats->ns / stats->frames : 0,
+		stats->state, current);
 
-		if (apvt->encoder->Opt_AMR_WB) {
-			amr_wb_enc(apvt->encoder, in, n_samples);
-		} else {
-			evs_enc(apvt->encoder, in, n_samples);
-		}
+	ast_debug(1, "%s (3GPP EVS): %u frames, %u DTX, %u CMR, %u concealed, %u corrupt, "
+		"%llu ns per frame; modes %s\n", pvt->t->name, stats->frames, evs_stats_dtx(stats),
+		stats->cmr, stats->concealed, stats->corrupt,
+		stats->frames ? stats->ns / stats->frames : 0, current);
+}
 
-		samples += n_samples;
-		pvt->samples -= n_samples;
+static void evs_encoder_init(struct evs_encoder *encoder)
+{
+	Encoder_State *st = &encoder->state;
 
-		bit_rate = rate2EVSmode(apvt->encoder->nb_bits_tot * 50);
-		if (bit_rate == NO_DATA) {
-			continue; /* happens in case of DTX */
-		} else if (bit_rate < 0) {
-			ast_log(LOG_ERROR, "Error encoding the 3GPP EVS frame (code: %d)\n", apvt->encoder->nb_bits_tot);
-			continue;
+	st->ind_list = encoder->ind_list;
+	st->input_Fs = encoder->config.input_Fs;
+	st->Opt_DTX_ON = encoder->config.Opt_DTX_ON;
+	st->var_SID_rate_flag = 1; /* Automatic interval */
+	st->Opt_AMR_WB = encoder->config.Opt_AMR_WB;
+	st->Opt_RF_ON = encoder->config.Opt_RF_ON;
+	st->rf_fec_offset = encoder->config.rf_fec_offset;
+	st->rf_fec_indicator = 1; /* Frame-erasure-rate indicator = HI */
+	st->Opt_SC_VBR = encoder->config.Opt_SC_VBR;
+	st->max_bwidth = encoder->config.max_bwidth;
+	st->total_brate = encoder->config.total_brate;
+	st->codec_mode = select_mode(st->Opt_AMR_WB, st->Opt_RF_ON, st->total_brate);
+	st->last_codec_mode = st->codec_mode;
+
+	/* After setting the above parameters (some set other parameters) */
+	init_encoder(st);
+}
+
+static int evs_encoder_config_cmp(const struct evs_encoder_config *config1,
+	const struct evs_encoder_config *config2)
+{
+	return config1->input_Fs != config2->input_Fs ||
+		config1->Opt_DTX_ON != config2->Opt_DTX_ON ||
+		config1->Opt_AMR_WB != config2->Opt_AMR_WB ||
+		config1->Opt_RF_ON != config2->Opt_RF_ON ||
+		config1->rf_fec_offset != config2->rf_fec_offset ||
+		config1->Opt_SC_VBR != config2->Opt_SC_VBR ||
+		config1->max_bwidth != config2->max_bwidth ||
+		config1->total_brate != config2->total_brate;
+}
+
+static Encoder_State *evs_encoder_get(const struct evs_encoder_config *config)
+{
+	struct evs_encoder *encoder = NULL;
+	struct evs_encoder *current;
+	int reused = 0;
+
+	ast_mutex_lock(&evs_pool_lock);
+	AST_LIST_TRAVERSE_SAFE_BEGIN(&evs_encoder_pool, current, list) {
+		if (!evs_encoder_config_cmp(&current->config, config)) {
+			AST_LIST_REMOVE_CURRENT(list);
+			encoder = current;
+			break;
 		}
+	}
+	AST_LIST_TRAVERSE_SAFE_END;
+	if (encoder) {
+		evs_encoder_pool_hits = evs_encoder_pool_hits + 1;
+	} else {
+		evs_encoder_pool_misses = evs_encoder_pool_misses + 1;
+		/* Different parameters; at least, the memory can be re-used */
+		encoder = AST_LIST_REMOVE_HEAD(&evs_encoder_pool, list);
+		reused = (NULL != encoder);
+	}
+	if (encoder) {
+		evs_encoder_pool_count = evs_encoder_pool_count - 1;
+	}
+	ast_mutex_unlock(&evs_pool_lock);
 
-		/* Change Mode Request (CMR) */
-		if (apvt->encoder->Opt_AMR_WB || 1 == cmr) {
-			out[0] = 0x7f; /* NO_REQ = no change in mode requested */
-			out[0] = out[0] | 0x80; /* Header Type identification bit */
-			datalen = datalen + 1;
-			out++;
+	if (encoder && !reused) {
+		return &encoder->state; /* hit: already initialized */
+	}
+
+	if (reused) {
+		destroy_encoder(&encoder->state);
+	} else {
+		encoder = ast_malloc(sizeof(*encoder));
+		if (NULL == encoder) {
+			return NULL;
 		}
+	}
+	encoder->config = *config;
+	evs_encoder_init(encoder);
 
-		/* Table of Content (ToC), see lib_com/bitstream.c:write_indices */
-		out[0] = 0x00; /* Header Type identification and Followed bit */
-		out[0] |= (apvt->encoder->Opt_AMR_WB << 5); /* EVS mode bit */
-		out[0] |= (apvt->encoder->Opt_AMR_WB << 4); /* Quality bit */
-		out[0] |= bit_rate;
-		datalen = datalen + 1;
-		out++;
+	return &encoder->state;
+}
 
-		/* Payload: fill rest of buffer, which is going to be send via RTP */
-		indices_to_serial(apvt->encoder, out, &apvt->encoder->nb_bits_tot);
+static void evs_encoder_put(Encoder_State *state)
+{
+	/* state is the first member, therefore the address is the same */
+	struct evs_encoder *encoder = (struct evs_encoder *) state;
+	int keep;
 
-		/* Convert bits into bytes, +7 is for rounding-up */
-		datalen = datalen + ((apvt->encoder->nb_bits_tot + 7) / 8);
-		/* out was and is still part of pvt->outbuf.uc */
-		current = ast_trans_frameout(pvt, datalen, EVS_SAMPLES);
+	ast_mutex_lock(&evs_pool_lock);
+	keep = (evs_encoder_pool_count < evs_pool_max);
+	ast_mutex_unlock(&evs_pool_lock);
 
-		/* Everything used, therefore reset hidden index pointers */
-		reset_indices_enc(apvt->encoder);
+	destroy_encoder(state);
+	if (keep) {
+		/* Reset now, so the next translator path does not have to */
+		evs_encoder_init(encoder);
 
-		if (!current) {
-			continue;
-		} else if (last) {
-			AST_LIST_NEXT(last, frame_list) = current;
-		} else {
-			result = current;
+		/* Others might have filled the pool meanwhile */
+		ast_mutex_lock(&evs_pool_lock);
+		keep = (evs_encoder_pool_count < evs_pool_max);
+		if (keep) {
+			AST_LIST_INSERT_HEAD(&evs_encoder_pool, encoder, list);
+			evs_encoder_pool_count = evs_encoder_pool_count + 1;
+		}
+		ast_mutex_unlock(&evs_pool_lock);
+		if (!keep) {
+			destroy_encoder(state);
 		}
-		last = current;
 	}
 
-	/* Move the data at the end of the buffer to the front */
-	if (samples) {
-		memmove(apvt->buf, apvt->buf + samples, pvt->samples * 2);
+	if (!keep) {
+		ast_free(encoder);
 	}
-
-	return result;
 }
 
-static int evstolin_framein(struct ast_trans_pvt *pvt, struct ast_frame *f)
+static void evs_decoder_init(struct evs_decoder *decoder)
 {
-	/* ToDo: 1) Packet-Loss Concealment (PLC)
-	 *       2) several frames; currently just one frame
-	 *       3) Compact format; currently only Header-Full format */
-	struct evs_coder_pvt *apvt = pvt->pvt;
-	const short n_samples = pvt->t->dst_codec.sample_rate / 50;
+	decoder->state.output_Fs = decoder->output_Fs;
+	init_decoder(&decoder->state);
+}
 
-	struct evs_attr *attr = ast_format_get_attribute_data(f->subclass.format);
-	unsigned char *in = f->data.ptr;
-	unsigned char *payload = in;
-	const frameMode bad_frame = FRAMEMODE_NORMAL;
-	unsigned int toc_byte = in[0];
-	UWord16 core_mode;
-	unsigned int num_bits;
+static Decoder_State *evs_decoder_get(int output_Fs)
+{
+	struct evs_decoder *decoder = NULL;
+	struct evs_decoder *current;
+	int reused = 0;
 
-	if (toc_byte & 0x80) { /* Header Type identification bit */
-		/* not Table of Content (ToC) but Change-Mode Request (CMR) */
-		if (attr && toc_byte <= 0x7f) { /* 0xff = NO_REQ */
-			attr->mode_current = toc_byte;
+	ast_mutex_lock(&evs_pool_lock);
+	AST_LIST_TRAVERSE_SAFE_BEGIN(&evs_decoder_pool, current, list) {
+		if (current->output_Fs == output_Fs) {
+			AST_LIST_REMOVE_CURRENT(list);
+			decoder = current;
+			break;
 		}
-		/* next byte is ToC */
-		in++; payload++;
-		toc_byte = in[0];
 	}
-
-	if (toc_byte & 0x80) { /* Header Type identification bit */
-		ast_log(LOG_ERROR, "2nd CMR; bitstream is corrupted\n");
+	AST_LIST_TRAVERSE_SAFE_END;
+	if (decoder) {
+		evs_decoder_pool_hits = evs_decoder_pool_hits + 1;
+	} else {
+		evs_decoder_pool_misses = evs_decoder_pool_misses + 1;
+		decoder = AST_LIST_REMOVE_HEAD(&evs_decoder_pool, list);
+		reused = (NULL != decoder);
+	}
+	if (decoder) {
+		evs_decoder_pool_count = evs_decoder_pool_count - 1;
 	}
+	ast_mutex_unlock(&evs_pool_lock);
 
-	if (toc_byte & 0x40) { /* Followed bit */
-		ast_log(LOG_ERROR, "2nd frame; bitstream is corrupted\n"); /* ToDo */
+	if (decoder && !reused) {
+		return &decoder->state;
 	}
 
-	core_mode = toc_byte & 0x0f;
-	if (toc_byte & 0x20) { /* EVS mode bit */
-		apvt->decoder->Opt_AMR_WB = 1;
-		apvt->decoder->bfi = !(toc_byte & 0x10); /* Quality bit */
-		apvt->decoder->total_brate = AMRWB_IOmode2rate[core_mode];
+	if (reused) {
+		destroy_decoder(&decoder->state);
 	} else {
-		apvt->decoder->Opt_AMR_WB = 0;
-		apvt->decoder->bfi = 0; /* Bad frame indicator; ignored for EVS */
-		apvt->decoder->total_brate = PRIMARYmode2rate[core_mode];
+		decoder = ast_malloc(sizeof(*decoder));
+		if (NULL == decoder) {
+			return NULL;
+		}
 	}
-	/* Next byte is Payload */
-	payload++;
+	decoder->output_Fs = output_Fs;
+	evs_decoder_init(decoder);
 
-	num_bits = apvt->decoder->total_brate / 50;
-	if (MAX_BITS_PER_FRAME < num_bits) {
-		ast_log(LOG_ERROR, "more than %d bits; bitstream is corrupted\n",
-			MAX_BITS_PER_FRAME);
-	}
-	/* AMR payload is reordered on the wire, see lib_com/mime.h
-	 * and lib_com/bitsream.c:read_indices_mime */
-	if (apvt->decoder->Opt_AMR_WB) {
-		UWord8 mask = 0x80;
-		int i;
+	return &decoder->state;
+}
 
-		/* Clear all bytes of the buffer */
-		for (i = 0; i < ((num_bits + 7) / 8); i = i + 1) {
-			apvt->fra[i] = 0x00;
+static void evs_decoder_put(Decoder_State *state)
+{
+	struct evs_decoder *decoder = (struct evs_decoder *) state;
+	int keep;
+
+	ast_mutex_lock(&evs_pool_lock);
+	keep = (evs_decoder_pool_count < evs_pool_max);
+	ast_mutex_unlock(&evs_pool_lock);
+
+	destroy_decoder(state);
+	if (keep) {
+		evs_decoder_init(decoder);
+
+		/* Others might have filled the pool meanwhile */
+		ast_mutex_lock(&evs_pool_lock);
+		keep = (evs_decoder_pool_count < evs_pool_max);
+		if (keep) {
+			AST_LIST_INSERT_HEAD(&evs_decoder_pool, decoder, list);
+			evs_decoder_pool_count = evs_decoder_pool_count + 1;
+		}
+		ast_mutex_unlock(&evs_pool_lock);
+		if (!keep) {
+			destroy_decoder(state);
+		}
+	}
+
+	if (!keep) {
+		ast_free(decoder);
+	}
+}
+
+/* Frees idle states until at most max states per direction are left */
+static void evs_pool_trim(unsigned int max)
+{
+	struct evs_encoder *encoder;
+	struct evs_decoder *decoder;
+
+	ast_mutex_lock(&evs_pool_lock);
+	while (evs_encoder_pool_count > max) {
+		encoder = AST_LIST_REMOVE_HEAD(&evs_encoder_pool, list);
+		evs_encoder_pool_count = evs_encoder_pool_count - 1;
+		destroy_encoder(&encoder->state);
+		ast_free(encoder);
+	}
+	while (evs_decoder_pool_count > max) {
+		decoder = AST_LIST_REMOVE_HEAD(&evs_decoder_pool, list);
+		evs_decoder_pool_count = evs_decoder_pool_count - 1;
+		destroy_decoder(&decoder->state);
+		ast_free(decoder);
+	}
+	ast_mutex_unlock(&evs_pool_lock);
+}
+
+/* Initializes idle states for the default parameters of each sample rate */
+static void evs_pool_fill(unsigned int count)
+{
+	static const int rates[] = { 8000, 16000, 32000, 48000 };
+	unsigned int i, j;
+
+	for (j = 0; j < ARRAY_LEN(rates); j = j + 1) {
+		for (i = 0; i < count; i = i + 1) {
+			struct evs_encoder *encoder = ast_malloc(sizeof(*encoder));
+			struct evs_decoder *decoder = ast_malloc(sizeof(*decoder));
+
+			if (NULL == encoder || NULL == decoder) {
+				ast_free(encoder);
+				ast_free(decoder);
+				return;
+			}
+
+			evs_encoder_config_set(&encoder->config, NULL, rates[j]);
+			evs_encoder_init(encoder);
+			decoder->output_Fs = rates[j];
+			evs_decoder_init(decoder);
+
+			ast_mutex_lock(&evs_pool_lock);
+			AST_LIST_INSERT_HEAD(&evs_encoder_pool, encoder, list);
+			evs_encoder_pool_count = evs_encoder_pool_count + 1;
+			AST_LIST_INSERT_HEAD(&evs_decoder_pool, decoder, list);
+			evs_decoder_pool_count = evs_decoder_pool_count + 1;
+			ast_mutex_unlock(&evs_pool_lock);
+		}
+	}
+}
+
+/* Offset of partial copies: ch-aw-send/recv allows 2, 3, 5, or 7 only;
+ * other values are rounded up to the next valid one; 0 is none */
+static int evs_rf_fec_offset(int offset)
+{
+	int d = 0;
+
+	if (offset <= 0) {
+		return 0;
+	}
+	while (d < ARRAY_LEN(rf_fec_offsets) - 1 && rf_fec_offsets[d] < offset) {
+		d = d + 1;
+	}
+
+	return rf_fec_offsets[d];
+}
+
+/* Derives the encoder parameters from the negotiated format attributes */
+static void evs_encoder_config_set(struct evs_encoder_config *config,
+	const struct evs_attr *attr, unsigned int sample_rate)
+{
+	const int channel_aware = attr ? MIN(attr->ch_aw_send, attr->ch_aw_recv) : -2;
+	const unsigned int dtx_on = attr ? MIN(attr->dtx, attr->dtx_send) : 0;
+	const int amr_wb = attr ? attr->evs_mode_switch : -1;
+	const int max_bandwidth = attr ? /* WB matches all bit-rates */
+		floor(log10(attr->bw_send) / log10(2)) - 1 : WB;
+	int bit_rate_evs = attr ? /* 16.4 is available in all bandwidths */
+		floor(log10(attr->br_send) / log10(2)) - 1 : PRIMARY_16400;
+	int bit_rate_amr;
+
+	if (attr && 0 < attr->mode_set) {
+		bit_rate_amr = floor(log10(attr->mode_set) / log10(2));
+	} else {
+		bit_rate_amr = AMRWB_IO_2385;
+	}
+
+	memset(config, 0, sizeof(*config));
+	config->input_Fs = sample_rate;
+	/* Value range:  0..2, see res/res_format_attr_evs.c */
+	config->Opt_DTX_ON = (0 < dtx_on);
+	/* Value range: -1..1, see res/res_format_attr_evs.c */
+	config->Opt_AMR_WB = (0 < amr_wb);
+	/* Value range: -2..7, see res/res_format_attr_evs.c */
+	config->Opt_RF_ON = (0 < channel_aware);
+	if (config->Opt_RF_ON) {
+		/* EVS library crashed with higher values */
+		config->rf_fec_offset = evs_rf_fec_offset(channel_aware);
+	} else {
+		/* Must be set although it should follow Opt_RF_ON */
+		config->rf_fec_offset = 0;
+	}
+
+	/* Variable bit-rate (SC-VBR) requires DTX according to the 3GPP EVS
+	 * library "lib_enc/io_enc.c:io_ini_enc" cases:
+	 * 1) st->Opt_SC_VBR && !st->Opt_DTX_ON
+	 * 2) st->total_brate == ACELP_5k90 */
+	config->Opt_SC_VBR = (0 == bit_rate_evs);
+	if (sample_rate <= 8000 || max_bandwidth == NB) {
+		config->max_bwidth = NB;
+	} else if (sample_rate <= 16000 || max_bandwidth == WB || config->Opt_SC_VBR) {
+		config->max_bwidth = WB;
+	} else if (sample_rate <= 32000 || max_bandwidth == SWB) {
+		config->max_bwidth = SWB;
+	} else {
+		config->max_bwidth = FB;
+	}
+	if (config->Opt_AMR_WB) {
+		config->total_brate = AMRWB_IOmode2rate[bit_rate_amr];
+	} else if (config->Opt_SC_VBR) {
+		config->total_brate = PRIMARYmode2rate[PRIMARY_7200];
+	} else {
+		bit_rate_evs = select_bit_rate(bit_rate_evs, config->max_bwidth);
+		config->total_brate = PRIMARYmode2rate[bit_rate_evs];
+	}
+}
+
+/*
+ * Builds the steps of the rate control from the negotiated bit-rates,
+ * up to the initial bit-rate. Channel-Aware mode (CA) is a step below
+ * 13.2 kbps, if the receiver did not disable it (ch-aw-recv=-1).
+ */
+static void evs_rate_control_init(struct evs_rate_control *rc,
+	const struct evs_attr *attr, const struct evs_encoder_config *config)
+{
+	int mode;
+
+	memset(rc, 0, sizeof(*rc));
+	if (!evs_rtcp_feedback || NULL == attr || config->Opt_AMR_WB || config->Opt_SC_VBR) {
+		return;
+	}
+
+	for (mode = PRIMARY_7200; mode <= PRIMARY_128000; mode = mode + 1) {
+		if (PRIMARYmode2rate[mode] > config->total_brate) {
+			break;
+		}
+		if (!(attr->br_send & (1 << (mode + 1))) || select_bit_rate(mode, config->max_bwidth) != mode) {
+			continue;
+		}
+		if (PRIMARY_13200 == mode && -1 != MIN(attr->ch_aw_send, attr->ch_aw_recv) &&
+			NB != config->max_bwidth) {
+			rc->steps[rc->count].mode = mode;
+			rc->steps[rc->count].rf = 1;
+			if (config->Opt_RF_ON) {
+				rc->current = rc->count;
+			}
+			rc->count = rc->count + 1;
+		}
+		rc->steps[rc->count].mode = mode;
+		rc->steps[rc->count].rf = 0;
+		if (!config->Opt_RF_ON) {
+			rc->current = rc->count;
+		}
+		rc->count = rc->count + 1;
+	}
+	rc->rf_fec_offset = config->Opt_RF_ON ? config->rf_fec_offset : rf_fec_offsets[0];
+
+	if (rc->count < 2) {
+		rc->count = 0; /* nothing to choose from */
+	}
+}
+
+/*
+ * Packetization time (ptime) of the format. Without the attribute ptime,
+ * the configured one, when the remote party announced its maxptime, see
+ * parse_config. Otherwise, one frame per payload: the core does not set
+ * these attributes from SDP, and not every remote party accepts more.
+ */
+static int evs_frames_per_packet(const struct evs_attr *attr)
+{
+	unsigned int ptime = 20;
+
+	if (attr && attr->ptime) {
+		ptime = attr->ptime;
+	} else if (attr && attr->maxptime) {
+		ptime = evs_ptime;
+	}
+	if (attr && attr->maxptime) {
+		ptime = MIN(ptime, attr->maxptime);
+	}
+
+	return MAX(1, MIN(ptime / 20, EVS_MAX_FRAMES));
+}
+
+/*
+ * Asynchronous mode, see codecs.conf [evs] async_workers: the coder
+ * states run in a fixed pool of worker threads, each pinned to a core,
+ * instead of on the channel or bridge thread which calls the translator.
+ * Each translator has a ring of ASYNC_SLOTS steps, with one producer (the
+ * translator) and one consumer (its worker): the translator fills the
+ * slot at tail and publishes it on frameout; the worker runs all slots
+ * up to tail and publishes done. On frameout, the translator returns the
+ * results of all finished steps, in order. A result keeps the timing
+ * (ts, len, seqno) of the input it was made from. This pipelines one
+ * frame ahead and adds the duration of one frame. The translator waits
+ * only when all slots are in flight.
+ */
+#define ASYNC_SLOTS  4                  /* steps in flight per translator */
+/* Incoming frames per step, several with ast_translate of a list */
+#define ASYNC_FRAMES 4
+
+struct evs_async_input {
+	int count;                          /* frames */
+	int bytes;                          /* of data in use */
+	struct ast_frame frames[ASYNC_FRAMES];
+	unsigned char *data;                /* see evs_async_new */
+};
+
+struct evs_async_slot {
+	struct evs_async_input input;
+	struct ast_frame *result;           /* made from input; NULL if none */
+};
+
+struct evs_async_worker {
+	pthread_t thread;
+	int cpu;                            /* pinned to; -1 not; atomic */
+	ast_mutex_t lock;
+	ast_cond_t cond;                    /* queued */
+	ast_cond_t done;                    /* finished */
+	int stop;
+	AST_LIST_HEAD_NOLOCK(, evs_async) queue;
+	/* all protected by lock */
+	unsigned int calls;                 /* translators assigned */
+	unsigned int depth;                 /* queued */
+	unsigned int depth_max;
+	unsigned int jobs;
+	unsigned int waits;                 /* translator waited for a free slot */
+};
+
+struct evs_async {
+	struct evs_async_worker *worker;
+	ast_mutex_t lock;                   /* coder state, see evs_async_run */
+	/* Translator of the worker: own samples and outbuf, same coder; only
+	 * the fields which the framein and frameout of this module use */
+	struct ast_trans_pvt shadow;
+	int bytes;                          /* of data in each slot */
+	unsigned int head;                  /* oldest result; translator only */
+	unsigned int tail;                  /* filled; written by the translator */
+	unsigned int done;                  /* finished; written by the worker */
+	int queued;                         /* with the lock of the worker */
+	struct evs_async_slot slots[ASYNC_SLOTS];
+	AST_LIST_ENTRY(evs_async) list;
+	unsigned char data[];               /* outbuf, then the data of the slots */
+};
+
+static struct evs_async_worker *evs_workers;
+static unsigned int evs_workers_count;
+static unsigned int evs_workers_next;
+
+/* Runs one step on the worker */
+static struct ast_frame *evs_async_run(struct evs_async *async, struct evs_async_input *input)
+{
+	struct ast_trans_pvt *shadow = &async->shadow;
+	struct ast_frame *result;
+	int i;
+
+	ast_mutex_lock(&async->lock);
+	for (i = 0; i < input->count; i = i + 1) {
+		struct ast_frame *f = &input->frames[i];
+
+		/* As the core does in framein for the translator */
+		ast_copy_flags(&shadow->f, f, AST_FRFLAG_HAS_TIMING_INFO);
+		shadow->f.ts = f->ts;
+		shadow->f.len = f->len;
+		shadow->f.seqno = f->seqno;
+		shadow->t->framein(shadow, f);
+		ao2_cleanup(f->subclass.format);
+		f->subclass.format = NULL;
+	}
+	input->count = 0;
+	input->bytes = 0;
+	result = shadow->t->frameout(shadow);
+	ast_mutex_unlock(&async->lock);
+
+	return result;
+}
+
+static void *evs_async_thread(void *data)
+{
+	struct evs_async_worker *worker = data;
+
+#if defined(__linux__)
+	const int cpu = __atomic_load_n(&worker->cpu, __ATOMIC_RELAXED);
+
+	if (0 <= cpu) {
+		cpu_set_t cpus;
+
+		CPU_ZERO(&cpus);
+		CPU_SET(cpu, &cpus);
+		if (pthread_setaffinity_np(pthread_self(), sizeof(cpus), &cpus)) {
+			ast_log(LOG_NOTICE, "EVS worker not pinned to CPU %d\n", cpu);
+			__atomic_store_n(&worker->cpu, -1, __ATOMIC_RELAXED);
+		}
+	}
+#endif
+
+	ast_mutex_lock(&worker->lock);
+	while (!worker->stop) {
+		struct evs_async *async = AST_LIST_REMOVE_HEAD(&worker->queue, list);
+		unsigned int done;
+
+		if (NULL == async) {
+			ast_cond_wait(&worker->cond, &worker->lock);
+			continue;
+		}
+		worker->depth = worker->depth - 1;
+
+		/* Until the translator published no further slot */
+		done = async->done;
+		while (done != __atomic_load_n(&async->tail, __ATOMIC_ACQUIRE)) {
+			ast_mutex_unlock(&worker->lock);
+			while (done != __atomic_load_n(&async->tail, __ATOMIC_ACQUIRE)) {
+				struct evs_async_slot *slot = &async->slots[done % ASYNC_SLOTS];
+
+				slot->result = evs_async_run(async, &slot->input);
+				done = done + 1;
+				__atomic_store_n(&async->done, done, __ATOMIC_RELEASE);
+			}
+			ast_mutex_lock(&worker->lock);
+		}
+		async->queued = 0;
+		ast_cond_broadcast(&worker->done);
+	}
+	ast_mutex_unlock(&worker->lock);
+
+	return NULL;
+}
+
+static void evs_async_stop(void)
+{
+	unsigned int i;
+
+	for (i = 0; i < evs_workers_count; i = i + 1) {
+		struct evs_async_worker *worker = &evs_workers[i];
+
+		ast_mutex_lock(&worker->lock);
+		worker->stop = 1;
+		ast_cond_signal(&worker->cond);
+		ast_mutex_unlock(&worker->lock);
+		pthread_join(worker->thread, NULL);
+		ast_cond_destroy(&worker->done);
+		ast_cond_destroy(&worker->cond);
+		ast_mutex_destroy(&worker->lock);
+	}
+	ast_free(evs_workers);
+	evs_workers = NULL;
+	evs_workers_count = 0;
+}
+
+static void evs_async_start(unsigned int count)
+{
+	const long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+	unsigned int i;
+
+	if (0 == count) {
+		return;
+	}
+
+	evs_workers = ast_calloc(count, sizeof(*evs_workers));
+	if (NULL == evs_workers) {
+		return;
+	}
+
+	for (i = 0; i < count; i = i + 1) {
+		struct evs_async_worker *worker = &evs_workers[i];
+
+		worker->cpu = (0 < cpus) ? i % cpus : -1;
+		ast_mutex_init(&worker->lock);
+		ast_cond_init(&worker->cond, NULL);
+		ast_cond_init(&worker->done, NULL);
+		AST_LIST_HEAD_INIT_NOLOCK(&worker->queue);
+		if (ast_pthread_create_background(&worker->thread, NULL, evs_async_thread, worker)) {
+			ast_log(LOG_WARNING, "Unable to start EVS worker %u\n", i + 1);
+			ast_cond_destroy(&worker->done);
+			ast_cond_destroy(&worker->cond);
+			ast_mutex_destroy(&worker->lock);
+			break;
+		}
+		evs_workers_count = i + 1;
+	}
+
+	/* Transcoded synchronously, if there is no worker */
+	if (0 == evs_workers_count) {
+		ast_free(evs_workers);
+		evs_workers = NULL;
+	}
+	ast_debug(1, "Started %u EVS workers\n", evs_workers_count);
+}
+
+/*
+ * NULL, if synchronous; the shadow is set up on the first step
+ * \param bytes of input per step: payloads for a decoder, signed linear
+ *        for an encoder
+ */
+static struct evs_async *evs_async_new(struct ast_trans_pvt *pvt, int bytes)
+{
+	const int outbuf = AST_FRIENDLY_OFFSET + pvt->t->buf_size;
+	struct evs_async *async;
+	unsigned char *data;
+	int i;
+
+	if (0 == evs_workers_count) {
+		return NULL;
+	}
+
+	bytes = (bytes + CACHE_LINE - 1) / CACHE_LINE * CACHE_LINE;
+	async = ast_calloc(1, sizeof(*async) + outbuf + CACHE_LINE - 1 + ASYNC_SLOTS * bytes);
+	if (NULL == async) {
+		return NULL;
+	}
+	ast_mutex_init(&async->lock);
+	async->bytes = bytes;
+	data = cache_line_align(async->data + outbuf);
+	for (i = 0; i < ASYNC_SLOTS; i = i + 1) {
+		async->slots[i].input.data = data + i * bytes;
+	}
+	async->worker = &evs_workers[__atomic_fetch_add(&evs_workers_next, 1, __ATOMIC_RELAXED) %
+		evs_workers_count];
+
+	ast_mutex_lock(&async->worker->lock);
+	async->worker->calls = async->worker->calls + 1;
+	ast_mutex_unlock(&async->worker->lock);
+
+	return async;
+}
+
+/* The fields of the translator which this module uses, see evs_async_run */
+static void evs_async_shadow_init(struct evs_async *async, struct ast_trans_pvt *pvt)
+{
+	struct ast_trans_pvt *shadow = &async->shadow;
+
+	shadow->t = pvt->t;
+	shadow->pvt = pvt->pvt;
+	shadow->outbuf.uc = async->data + AST_FRIENDLY_OFFSET;
+	shadow->explicit_dst = ao2_bump(pvt->explicit_dst);
+	shadow->f.subclass.format = ao2_bump(pvt->f.subclass.format);
+}
+
+static void evs_async_destroy(struct evs_async *async)
+{
+	struct evs_async_worker *worker = async->worker;
+	struct evs_async_input *input = &async->slots[async->tail % ASYNC_SLOTS].input;
+	int i;
+
+	ast_mutex_lock(&worker->lock);
+	while (async->queued) {
+		ast_cond_wait(&worker->done, &worker->lock);
+	}
+	worker->calls = worker->calls - 1;
+	ast_mutex_unlock(&worker->lock);
+
+	for (; async->head != async->done; async->head = async->head + 1) {
+		struct evs_async_slot *slot = &async->slots[async->head % ASYNC_SLOTS];
+
+		if (slot->result) {
+			ast_frfree(slot->result);
+		}
+	}
+	for (i = 0; i < input->count; i = i + 1) {
+		ao2_cleanup(input->frames[i].subclass.format);
+	}
+	ao2_cleanup(async->shadow.explicit_dst);
+	ao2_cleanup(async->shadow.f.subclass.format);
+	ast_mutex_destroy(&async->lock);
+	ast_free(async);
+}
+
+/* Takes a frame into the slot at tail */
+static int evs_async_framein(struct ast_trans_pvt *pvt, struct evs_async *async, struct ast_frame *f)
+{
+	struct evs_async_input *input = &async->slots[async->tail % ASYNC_SLOTS].input;
+	struct ast_frame *copy;
+
+	if (ASYNC_FRAMES == input->count || async->bytes < input->bytes + f->datalen) {
+		ast_log(LOG_WARNING, "Out of buffer space\n");
+		return -1;
+	}
+
+	copy = &input->frames[input->count];
+	memset(copy, 0, sizeof(*copy));
+	copy->frametype = f->frametype;
+	copy->subclass.format = ao2_bump(f->subclass.format);
+	copy->datalen = f->datalen;
+	copy->samples = f->samples;
+	copy->data.ptr = input->data + input->bytes;
+	ast_copy_flags(copy, f, AST_FRFLAG_HAS_TIMING_INFO);
+	copy->ts = f->ts;
+	copy->len = f->len;
+	copy->seqno = f->seqno;
+	memcpy(copy->data.ptr, f->data.ptr, f->datalen);
+
+	/* Whole samples keep the data of signed linear aligned */
+	input->bytes = input->bytes + f->datalen;
+	input->count = input->count + 1;
+	pvt->samples = pvt->samples + f->samples;
+
+	return 0;
+}
+
+/* Publishes the slot at tail and returns the results of all finished steps */
+static struct ast_frame *evs_async_frameout(struct ast_trans_pvt *pvt, struct evs_async *async)
+{
+	struct evs_async_worker *worker = async->worker;
+	const unsigned int tail = async->tail;
+	struct ast_frame *result = NULL;
+	struct ast_frame *last = NULL;
+	unsigned int done;
+
+	if (NULL == async->shadow.t) {
+		evs_async_shadow_init(async, pvt);
+	}
+
+	if (async->slots[tail % ASYNC_SLOTS].input.count) {
+		__atomic_store_n(&async->tail, tail + 1, __ATOMIC_RELEASE);
+
+		ast_mutex_lock(&worker->lock);
+		worker->jobs = worker->jobs + 1;
+		if (!async->queued) {
+			async->queued = 1;
+			AST_LIST_INSERT_TAIL(&worker->queue, async, list);
+			worker->depth = worker->depth + 1;
+			worker->depth_max = MAX(worker->depth_max, worker->depth);
+			ast_cond_signal(&worker->cond);
+		}
+		/* The next slot to fill is still in flight */
+		if (ASYNC_SLOTS == tail + 1 - async->head &&
+			async->head == __atomic_load_n(&async->done, __ATOMIC_ACQUIRE)) {
+			worker->waits = worker->waits + 1;
+			while (async->head == __atomic_load_n(&async->done, __ATOMIC_ACQUIRE)) {
+				ast_cond_wait(&worker->done, &worker->lock);
+			}
+		}
+		ast_mutex_unlock(&worker->lock);
+	}
+
+	done = __atomic_load_n(&async->done, __ATOMIC_ACQUIRE);
+	for (; async->head != done; async->head = async->head + 1) {
+		struct evs_async_slot *slot = &async->slots[async->head % ASYNC_SLOTS];
+
+		if (NULL == slot->result) {
+			continue;
+		} else if (last) {
+			AST_LIST_NEXT(last, frame_list) = slot->result;
+		} else {
+			result = slot->result;
+		}
+		last = slot->result;
+		while (AST_LIST_NEXT(last, frame_list)) {
+			last = AST_LIST_NEXT(last, frame_list);
+		}
+		slot->result = NULL;
+	}
+
+	pvt->samples = 0;
+	pvt->datalen = 0;
+
+	return result;
+}
+
+/* FNV-1a, for the input of a shared encoder, see evs_shared_frameout */
+#define FNV_OFFSET 14695981039346656037ULL
+#define FNV_PRIME  1099511628211ULL
+
+static unsigned long long evs_hash(unsigned long long hash, const unsigned char *data, int bytes)
+{
+	int i;
+
+	for (i = 0; i < bytes; i = i + 1) {
+		hash = (hash ^ data[i]) * FNV_PRIME;
+	}
+
+	return hash;
+}
+
+/* Digital silence: the same in unrelated calls, see evs_shared_find */
+static int evs_silent(const short *data, int samples)
+{
+	int i;
+
+	for (i = 0; i < samples; i = i + 1) {
+		if (data[i]) {
+			return 0;
+		}
+	}
+
+	return 1;
+}
+
+/*
+ * Encoder state of a translator, without the statistics, the mailbox, the
+ * rate control, or the worker of a call; see lintoevs_new and
+ * evs_shared_pvt_new
+ */
+static int evs_encoder_pvt_init(struct ast_trans_pvt *pvt, const struct evs_attr *attr,
+	struct evs_encoder_config *config)
+{
+	struct evs_encoder_pvt *apvt = pvt->pvt;
+	const unsigned int sample_rate = pvt->t->src_codec.sample_rate;
+	int bit_rate_evs;
+
+	apvt->buf = cache_line_align(apvt->data);
+	apvt->window = apvt->buf + ENCODER_BUFFER_SAMPLES(sample_rate);
+	apvt->frames_per_packet = evs_frames_per_packet(attr);
+
+	evs_encoder_config_set(config, attr, sample_rate);
+	apvt->encoder = evs_encoder_get(config);
+	if (NULL == apvt->encoder) {
+		ast_log(LOG_ERROR, "Error creating the 3GPP EVS encoder\n");
+		return -1;
+	}
+
+	/* Initial mode, as if requested via CMR, see lintoevs_frameout;
+	 * SC-VBR is signaled as 5.9, see evs_encoder_config_set */
+	bit_rate_evs = config->Opt_SC_VBR ? PRIMARY_2800 : rate2EVSmode(config->total_brate);
+	if (apvt->encoder->Opt_AMR_WB) {
+		apvt->mode = 0x10 + rate2AMRWB_IOmode(config->total_brate);
+	} else if (apvt->encoder->Opt_RF_ON) { /* D bits: LO with offset */
+		int d = ARRAY_LEN(rf_fec_offsets) - 1;
+
+		while (0 < d && rf_fec_offsets[d] > config->rf_fec_offset) {
+			d = d - 1;
+		}
+		apvt->mode = ((apvt->encoder->max_bwidth == WB) ? 0x50 : 0x60) + d;
+	} else if (apvt->encoder->max_bwidth ==  NB) {
+		apvt->mode = 0x00 + bit_rate_evs;
+	} else if (apvt->encoder->max_bwidth ==  WB) {
+		apvt->mode = 0x20 + bit_rate_evs;
+	} else if (apvt->encoder->max_bwidth == SWB) {
+		apvt->mode = 0x30 + bit_rate_evs;
+	} else { /* FB */
+		apvt->mode = 0x40 + bit_rate_evs;
+	}
+
+	return 0;
+}
+
+static int lintoevs_new(struct ast_trans_pvt *pvt)
+{
+	struct evs_encoder_pvt *apvt = pvt->pvt;
+	const unsigned int sample_rate = pvt->t->src_codec.sample_rate;
+
+	struct evs_attr *attr = pvt->explicit_dst ?
+		ast_format_get_attribute_data(pvt->explicit_dst) : NULL;
+	struct evs_encoder_config config;
+
+	if (evs_encoder_pvt_init(pvt, attr, &config)) {
+		return -1;
+	}
+
+	/* Mode requests from the decoder of the same call */
+	apvt->mailbox = attr ? ao2_bump(attr->mailbox) : NULL;
+
+	evs_rate_control_init(&apvt->rc, attr, &config);
+
+	/* Rate control adapts each call on its own */
+	if (evs_shared_encoder && 0 == apvt->rc.count) {
+		apvt->shareable = 1;
+		apvt->key.config = config;
+		apvt->key.frames_per_packet = apvt->frames_per_packet;
+		apvt->key.cmr = attr ? attr->cmr : 0;
+		apvt->key.hf_only = attr ? attr->hf_only : -1;
+		apvt->key.mode = apvt->mode;
+		apvt->boundary = 1;
+		apvt->step_silent = 1;
+		apvt->step_hash = FNV_OFFSET;
+	}
+
+	/* The signed linear of one step fits into the ring of the encoder */
+	apvt->async = evs_async_new(pvt, ENCODER_BUFFER_SAMPLES(sample_rate) * sizeof(int16_t));
+
+	evs_stats_state(pvt, &apvt->stats, &evs_encoder_stats, sizeof(struct evs_encoder));
+	__atomic_add_fetch(&evs_encoders_active, 1, __ATOMIC_RELAXED);
+
+	ast_debug(3, "Created encoder (3GPP EVS) with sample rate %d and ptime %d%s\n",
+		sample_rate, apvt->frames_per_packet * 20, apvt->async ? ", asynchronous" : "");
+	return 0;
+}
+
+static int evstolin_new(struct ast_trans_pvt *pvt)
+{
+	struct evs_decoder_pvt *apvt = pvt->pvt;
+	const unsigned int sample_rate = pvt->t->dst_codec.sample_rate;
+
+	apvt->con = cache_line_align(apvt->data);
+	apvt->bandwidth = -1;
+	apvt->bandwidth_recv = -1;
+	apvt->seqno = -1;
+	apvt->frames = 1;
+
+	apvt->decoder = evs_decoder_get(sample_rate);
+	if (NULL == apvt->decoder) {
+		ast_log(LOG_ERROR, "Error creating the 3GPP EVS decoder\n");
+		return -1;
+	}
+
+	if (evs_jbm) {
+		if (EVS_RX_NO_ERROR != EVS_RX_Open(&apvt->jbm, apvt->decoder, JBM_SAFETY_MARGIN)) {
+			ast_log(LOG_ERROR, "Error creating the 3GPP EVS jitter buffer\n");
+			evs_decoder_put(apvt->decoder);
+			apvt->decoder = NULL;
+			return -1;
+		}
+		apvt->jbm_start = ast_tvnow();
+		ast_mutex_lock(&evs_jbm_lock);
+		evs_jbm_sessions = evs_jbm_sessions + 1;
+		ast_mutex_unlock(&evs_jbm_lock);
+	}
+
+	apvt->async = evs_async_new(pvt, ASYNC_FRAMES * ENCODER_PAYLOAD_BYTES);
+
+	evs_stats_state(pvt, &apvt->stats, &evs_decoder_stats, sizeof(struct evs_decoder));
+	__atomic_add_fetch(&evs_decoders_active, 1, __ATOMIC_RELAXED);
+
+	ast_debug(3, "Created decoder (3GPP EVS) with sample rate %d%s%s\n", sample_rate,
+		apvt->jbm ? " and jitter buffer" : "", apvt->async ? ", asynchronous" : "");
+	return 0;
+}
+
+/* Appends to the ring buffer of the encoder */
+static void evs_ring_write(struct ast_trans_pvt *pvt, const short *data, int samples)
+{
+	struct evs_encoder_pvt *apvt = pvt->pvt;
+	const int capacity = ENCODER_BUFFER_SAMPLES(pvt->t->src_codec.sample_rate);
+	const int tail = (apvt->head + pvt->samples) % capacity;
+	const int count = MIN(samples, capacity - tail);
+
+	memcpy(apvt->buf + tail, data, count * sizeof(*data));
+	memcpy(apvt->buf, data + count, (samples - count) * sizeof(*data));
+	pvt->samples += samples;
+}
+
+/* Next 20 ms of the ring buffer, contiguous */
+static const short *evs_ring_read(struct ast_trans_pvt *pvt, int samples)
+{
+	struct evs_encoder_pvt *apvt = pvt->pvt;
+	const int capacity = ENCODER_BUFFER_SAMPLES(pvt->t->src_codec.sample_rate);
+	const short *in = apvt->buf + apvt->head;
+
+	if (capacity < apvt->head + samples) {
+		const int count = capacity - apvt->head;
+
+		memcpy(apvt->window, in, count * sizeof(*in));
+		memcpy(apvt->window + count, apvt->buf, (samples - count) * sizeof(*in));
+		in = apvt->window;
+	}
+	apvt->head = (apvt->head + samples) % capacity;
+
+	return in;
+}
+
+static int lintoevs_framein(struct ast_trans_pvt *pvt, struct ast_frame *f)
+{
+	struct evs_encoder_pvt *apvt = pvt->pvt;
+	const unsigned int sample_rate = pvt->t->src_codec.sample_rate;
+	const struct timeval now = ast_tvnow();
+
+	evs_stats_internal(pvt, &apvt->stats, f);
+
+	/* Called by the core, not by the worker, see evs_async_run */
+	if (apvt->async && pvt != &apvt->async->shadow) {
+		return evs_async_framein(pvt, apvt->async, f);
+	}
+
+	/* The core checks the space in samples of the destination rate */
+	if (pvt->samples + f->samples > ENCODER_BUFFER_SAMPLES(sample_rate)) {
+		ast_log(LOG_WARNING, "Out of buffer space\n");
+		return -1;
+	}
+
+	/* The rest of an earlier talk spurt does not belong to this one */
+	if (pvt->samples && !apvt->direct && ENCODER_STALE_MS < ast_tvdiff_ms(now, apvt->last)) {
+		pvt->samples = 0;
+	}
+	apvt->last = now;
+
+	if (apvt->shareable) {
+		apvt->step_hash = evs_hash(apvt->step_hash, f->data.ptr, f->datalen);
+		apvt->step_silent = apvt->step_silent && evs_silent(f->data.ptr, f->samples);
+	}
+
+	/* Whole 20 ms frames: read without copy, see lintoevs_frameout */
+	if (0 == pvt->samples && 0 < f->samples && 0 == f->samples % FRAME_SAMPLES(sample_rate)) {
+		apvt->direct = f->data.ptr;
+		pvt->samples = f->samples;
+		return 0;
+	}
+
+	/* Several frames before lintoevs_frameout: the first one is copied now */
+	if (apvt->direct) {
+		const short *direct = apvt->direct;
+		const int samples = pvt->samples;
+
+		apvt->direct = NULL;
+		pvt->samples = 0;
+		evs_ring_write(pvt, direct, samples);
+	}
+	evs_ring_write(pvt, f->data.ptr, f->samples);
+
+	return 0;
+}
+
+/* Applies a mode as signaled in a Change-Mode Request (CMR) */
+static void evs_encoder_set_mode(Encoder_State *encoder, int mode, unsigned int sample_rate)
+{
+	const unsigned int max_bandwidth = ((sample_rate / 8000) >> 1);
+	const int bandwidth = (mode & 0x70);
+	const unsigned int bit_rate = (mode & 0x0f);
+
+	if (0x10 == bandwidth) {
+		encoder->Opt_AMR_WB = 1;
+		encoder->total_brate = AMRWB_IOmode2rate[bit_rate];
+	} else if (mode <= 0x7f) { /* 0xff = NO_REQ */
+		encoder->Opt_AMR_WB = 0;
+		encoder->total_brate = PRIMARYmode2rate[bit_rate];
+		encoder->Opt_SC_VBR = 0;
+		encoder->Opt_RF_ON = 0;
+		if (0x00 == bandwidth) {
+			encoder->max_bwidth = MIN(max_bandwidth,  NB);
+			if (0 == bit_rate) {
+				encoder->Opt_SC_VBR = 1;
+				encoder->total_brate = PRIMARYmode2rate[PRIMARY_7200];
+			}
+		} else if (0x20 == bandwidth) {
+			encoder->max_bwidth = MIN(max_bandwidth,  WB);
+			if (0 == bit_rate) {
+				encoder->Opt_SC_VBR = 1;
+				encoder->total_brate = PRIMARYmode2rate[PRIMARY_7200];
+			}
+		} else if (0x30 == bandwidth) {
+			encoder->max_bwidth = MIN(max_bandwidth, SWB);
+		} else if (0x40 == bandwidth) {
+			encoder->max_bwidth = MIN(max_bandwidth,  FB);
+		} else if (0x50 == bandwidth) {
+			encoder->Opt_RF_ON = 1;
+			encoder->total_brate = PRIMARYmode2rate[PRIMARY_13200];
+			encoder->max_bwidth = MIN(max_bandwidth,  WB);
+		} else if (0x60 == bandwidth) {
+			encoder->Opt_RF_ON = 1;
+			encoder->total_brate = PRIMARYmode2rate[PRIMARY_13200];
+			encoder->max_bwidth = MIN(max_bandwidth, SWB);
+		} /* else (0x70) is reserved; do nothing */
+		if (0x50 == bandwidth || 0x60 == bandwidth) {
+			/* D bits: LO (0..3) or HI (4..7) with offset 2, 3, 5, or 7 */
+			if (bit_rate < 8) {
+				encoder->rf_fec_offset = rf_fec_offsets[bit_rate & 0x03];
+				encoder->rf_fec_indicator = (bit_rate >> 2);
+			}
+		}
+	}
+	encoder->codec_mode = select_mode(encoder->Opt_AMR_WB,
+		encoder->Opt_RF_ON, encoder->total_brate);
+}
+
+/* Limits the mode, as requested by CMR, to the step of the rate control */
+static void evs_rate_control_apply(Encoder_State *encoder, const struct evs_rate_control *rc)
+{
+	const struct evs_rate_step *step = &rc->steps[rc->current];
+
+	if (0 == rc->count || encoder->Opt_AMR_WB || encoder->Opt_SC_VBR) {
+		return;
+	}
+
+	if (step->rf) {
+		if (!encoder->Opt_RF_ON && PRIMARYmode2rate[PRIMARY_13200] <= encoder->total_brate &&
+			NB != encoder->max_bwidth) {
+			encoder->Opt_RF_ON = 1;
+			encoder->total_brate = PRIMARYmode2rate[PRIMARY_13200];
+		}
+		if (encoder->Opt_RF_ON) {
+			encoder->rf_fec_offset = rc->rf_fec_offset;
+			encoder->rf_fec_indicator = rc->rf_fec_indicator;
+		}
+	} else if (!encoder->Opt_RF_ON) {
+		encoder->total_brate = MIN(encoder->total_brate, PRIMARYmode2rate[step->mode]);
+	}
+
+	/* Lowest bit-rates of SWB and FB, see 3GPP TS 26.441 Table 1 */
+	if (encoder->total_brate < PRIMARYmode2rate[PRIMARY_9600]) {
+		encoder->max_bwidth = MIN(encoder->max_bwidth, WB);
+	} else if (encoder->total_brate < PRIMARYmode2rate[PRIMARY_16400] || encoder->Opt_RF_ON) {
+		encoder->max_bwidth = MIN(encoder->max_bwidth, SWB);
+	}
+
+	encoder->codec_mode = select_mode(encoder->Opt_AMR_WB,
+		encoder->Opt_RF_ON, encoder->total_brate);
+}
+
+/*
+ * Rate control by RTCP receiver reports (RR), see ASTERISK-26584: steps
+ * down on loss, jitter, or round-trip time (RTT); steps up only after
+ * several good reports in a row (hysteresis). The new step applies with
+ * the next payload, see lintoevs_frameout.
+ */
+static void evs_rate_control_update(struct evs_rate_control *rc, struct ast_frame *feedback)
+{
+	struct ast_rtp_rtcp_report *rtcp_report;
+	struct ast_rtp_rtcp_report_block *report_block;
+	unsigned int fraction_lost;
+	unsigned int jitter;
+	unsigned int rtt = 0;
+	int d;
+
+	if (0 == rc->count) {
+		return;
+	}
+
+	if (feedback->subclass.integer != AST_RTP_RTCP_SR &&
+		feedback->subclass.integer != AST_RTP_RTCP_RR) {
+		return;
+	}
+
+	rtcp_report = (struct ast_rtp_rtcp_report *) feedback->data.ptr;
+	if (0 == rtcp_report->reception_report_count) {
+		return;
+	}
+	report_block = rtcp_report->report_block[0];
+
+	fraction_lost = report_block->lost_count.fraction;
+	jitter = report_block->ia_jitter / (EVS_SAMPLES / 20); /* 16 kHz to ms */
+	if (report_block->lsr) {
+		/* Middle 32 bits of the NTP timestamp, in 1/65536 seconds */
+		const struct timeval now = ast_tvnow();
+		const unsigned int ntp = ((now.tv_sec + 2208988800UL) << 16) +
+			((unsigned long long) now.tv_usec << 16) / 1000000;
+		const unsigned int delay = ntp - report_block->lsr - report_block->dlsr;
+
+		if (delay < (60 << 16)) { /* otherwise the clocks are off */
+			rtt = (unsigned long long) delay * 1000 >> 16;
+		}
+	}
+
+	if (RC_LOSS_HIGH < fraction_lost || RC_JITTER_HIGH < jitter || RC_RTT_HIGH < rtt) {
+		rc->current = MAX(0, rc->current - 1);
+		rc->good = 0;
+	} else if (fraction_lost <= RC_LOSS_LOW && jitter <= RC_JITTER_LOW) {
+		rc->good = rc->good + 1;
+		if (RC_GOOD_REPORTS <= rc->good) {
+			rc->current = MIN(rc->count - 1, rc->current + 1);
+			rc->good = 0;
+		}
+	} else {
+		rc->good = 0; /* hold */
+	}
+
+	/* The partial copy must arrive before its frame is played out */
+	for (d = 0; d < ARRAY_LEN(rf_fec_offsets) - 1; d = d + 1) {
+		if (jitter <= (rf_fec_offsets[d] - 1) * 20) {
+			break;
+		}
+	}
+	rc->rf_fec_offset = rf_fec_offsets[d];
+	rc->rf_fec_indicator = (RC_LOSS_HIGH < fraction_lost);
+
+	ast_debug(4, "RTCP feedback (3GPP EVS): loss %u/256, jitter %u ms, RTT %u ms; "
+		"step %d of %d\n", fraction_lost, jitter, rtt, rc->current + 1, rc->count);
+}
+
+static void lintoevs_feedback(struct ast_trans_pvt *pvt, struct ast_frame *feedback)
+{
+	struct evs_encoder_pvt *apvt = pvt->pvt;
+
+	/* The encoder might be busy on its worker, see evs_async_run */
+	if (apvt->async) {
+		ast_mutex_lock(&apvt->async->lock);
+	}
+	evs_rate_control_update(&apvt->rc, feedback);
+	if (apvt->async) {
+		ast_mutex_unlock(&apvt->async->lock);
+	}
+}
+
+/*
+ * Shared encoder, see codecs.conf [evs] shared_encoder: many calls might
+ * get the same audio, like Music on Hold (MOH) or an announcement. The
+ * encoders of those calls would give the same payloads, when they run
+ * with the same parameters. Instead, each step of input is encoded once
+ * by a group. A translator continues the group it followed so far, as
+ * long as that group got the same input. Otherwise, the translator joins
+ * another group which encoded the same input for this step and for the
+ * step before, but only when both are at the start of a payload without
+ * samples left over; a group in the middle of a payload would send frames
+ * of another call. Digital silence is the same in unrelated calls; such a
+ * step never joins. Without a group to join, the translator starts a new
+ * one. The encoder of a group is a translator of its own, created from
+ * the one which starts it.
+ */
+/* Payloads of one step, an ao2 object shared by the members of a group */
+struct evs_shared_output {
+	struct ast_frame *frames;           /* NULL if none */
+};
+
+struct evs_shared {
+	struct evs_shared_key key;
+	ast_mutex_t encoding;               /* pvt; taken before lock */
+	ast_mutex_t lock;                   /* the last step, held briefly */
+	struct ast_trans_pvt *pvt;          /* on the first step */
+	/* Written with lock, read atomically by evs_shared_find */
+	unsigned int steps;                 /* encoded so far */
+	unsigned long long hash;            /* input of the last step */
+	unsigned long long prev;            /* input of the step before */
+	int joinable;                       /* before the last step, see evs_shared_boundary */
+	/* protected by lock */
+	int samples;                        /* input of the last step */
+	int boundary;                       /* after the last step */
+	struct evs_shared_output *output;   /* of the last step */
+	unsigned int members;               /* protected by evs_shared_lock */
+	AST_LIST_ENTRY(evs_shared) list;
+};
+
+AST_MUTEX_DEFINE_STATIC(evs_shared_lock);
+static AST_LIST_HEAD_NOLOCK_STATIC(evs_shared_groups, evs_shared);
+/* all protected by evs_shared_lock */
+static unsigned int evs_shared_count;
+static unsigned int evs_shared_calls;
+/* Steps of a translator: encoded for its group, or taken from it */
+static unsigned int evs_shared_encoded;
+static unsigned int evs_shared_reused;
+
+static int evs_shared_key_cmp(const struct evs_shared_key *key1,
+	const struct evs_shared_key *key2)
+{
+	return evs_encoder_config_cmp(&key1->config, &key2->config) ||
+		key1->frames_per_packet != key2->frames_per_packet ||
+		key1->cmr != key2->cmr ||
+		key1->hf_only != key2->hf_only ||
+		key1->mode != key2->mode;
+}
+
+/* Translator of the group, like the one which starts it but without CMR */
+static struct ast_trans_pvt *evs_shared_pvt_new(struct ast_trans_pvt *pvt)
+{
+	struct evs_attr *attr = pvt->explicit_dst ?
+		ast_format_get_attribute_data(pvt->explicit_dst) : NULL;
+	struct evs_encoder_config config;
+	struct ast_trans_pvt *shared;
+	struct evs_encoder_pvt *apvt;
+
+	shared = ast_calloc(1, sizeof(*shared) + pvt->t->desc_size + pvt->t->buf_size);
+	if (NULL == shared) {
+		return NULL;
+	}
+	shared->t = pvt->t;
+	shared->pvt = shared + 1;
+	shared->outbuf.c = (char *) shared->pvt + pvt->t->desc_size;
+	shared->f = pvt->f;
+	shared->f.subclass.format = ao2_bump(pvt->f.subclass.format);
+	shared->explicit_dst = ao2_bump(pvt->explicit_dst);
+
+	/* Not a call: neither counted as an active encoder nor asynchronous;
+	 * each member reads its own mailbox, see evs_shared_frameout */
+	if (evs_encoder_pvt_init(shared, attr, &config)) {
+		ao2_cleanup(shared->f.subclass.format);
+		ao2_cleanup(shared->explicit_dst);
+		ast_free(shared);
+		return NULL;
+	}
+
+	apvt = shared->pvt;
+	apvt->mode = ((struct evs_encoder_pvt *) pvt->pvt)->key.mode;
+	apvt->stats.internal = ((struct evs_encoder_pvt *) pvt->pvt)->stats.internal;
+
+	return shared;
+}
+
+static void evs_shared_output_destroy(void *obj)
+{
+	struct evs_shared_output *output = obj;
+
+	if (output->frames) {
+		ast_frfree(output->frames);
+	}
+}
+
+static void evs_shared_destroy(struct evs_shared *shared)
+{
+	if (shared->pvt) {
+		struct evs_encoder_pvt *apvt = shared->pvt->pvt;
+
+		/* The group encoded for its members, see lintoevs_destroy */
+		evs_stats_summary(shared->pvt, &apvt->stats, shared->pvt->t->src_codec.sample_rate);
+		evs_encoder_put(apvt->encoder);
+		ao2_cleanup(shared->pvt->f.subclass.format);
+		ao2_cleanup(shared->pvt->explicit_dst);
+		ast_free(shared->pvt);
+	}
+	ao2_cleanup(shared->output);
+	ast_mutex_destroy(&shared->lock);
+	ast_mutex_destroy(&shared->encoding);
+	ast_free(shared);
+}
+
+/* With evs_shared_lock; returns the group to destroy, if any */
+static struct evs_shared *evs_shared_leave(struct evs_shared *shared)
+{
+	shared->members = shared->members - 1;
+	evs_shared_calls = evs_shared_calls - 1;
+	if (shared->members) {
+		return NULL;
+	}
+
+	AST_LIST_REMOVE(&evs_shared_groups, shared, list);
+	evs_shared_count = evs_shared_count - 1;
+	return shared;
+}
+
+/* With the encoding lock of the group: its payload is complete, no samples left */
+static int evs_shared_boundary(const struct evs_shared *shared)
+{
+	const struct evs_encoder_pvt *apvt = shared->pvt ? shared->pvt->pvt : NULL;
+
+	return NULL == apvt || (0 == apvt->frames && 0 == shared->pvt->samples);
+}
+
+/* With evs_shared_lock; NULL on allocation failure */
+static struct evs_shared *evs_shared_find(struct evs_encoder_pvt *apvt, int fresh)
+{
+	struct evs_shared *shared = apvt->shared;
+
+	/* The group followed so far: this step is next, or encoded already */
+	if (!fresh && shared && !evs_shared_key_cmp(&shared->key, &apvt->key)) {
+		const unsigned int steps = __atomic_load_n(&shared->steps, __ATOMIC_ACQUIRE);
+
+		if (steps == apvt->step || (steps == apvt->step + 1 &&
+				__atomic_load_n(&shared->hash, __ATOMIC_RELAXED) == apvt->step_hash)) {
+			return shared;
+		}
+	}
+
+	/* Another group, with the same input for this step and the one before */
+	if (!fresh && !apvt->step_silent && apvt->boundary) {
+		AST_LIST_TRAVERSE(&evs_shared_groups, shared, list) {
+			const unsigned int steps = __atomic_load_n(&shared->steps, __ATOMIC_ACQUIRE);
+
+			if (shared != apvt->shared && 0 < steps &&
+				__atomic_load_n(&shared->joinable, __ATOMIC_RELAXED) &&
+				__atomic_load_n(&shared->hash, __ATOMIC_RELAXED) == apvt->step_hash &&
+				__atomic_load_n(&shared->prev, __ATOMIC_RELAXED) == apvt->last_hash &&
+				!evs_shared_key_cmp(&shared->key, &apvt->key)) {
+				apvt->step = steps - 1;
+				return shared;
+			}
+		}
+	}
+
+	shared = ast_calloc(1, sizeof(*shared));
+	if (NULL == shared) {
+		return NULL;
+	}
+	shared->key = apvt->key;
+	ast_mutex_init(&shared->encoding);
+	ast_mutex_init(&shared->lock);
+	AST_LIST_INSERT_HEAD(&evs_shared_groups, shared, list);
+	evs_shared_count = evs_shared_count + 1;
+	apvt->step = 0;
+
+	return shared;
+}
+
+/* Hands the input of this step to the group and encodes it */
+static struct ast_frame *evs_shared_encode(struct ast_trans_pvt *pvt, struct evs_shared *shared)
+{
+	struct evs_encoder_pvt *apvt = pvt->pvt;
+	const unsigned int sample_rate = pvt->t->src_codec.sample_rate;
+	const int n_samples = FRAME_SAMPLES(sample_rate);
+
+	if (NULL == shared->pvt) {
+		shared->pvt = evs_shared_pvt_new(pvt);
+		if (NULL == shared->pvt) {
+			ast_log(LOG_ERROR, "Error creating the shared 3GPP EVS encoder\n");
+			return NULL;
+		}
+	}
+
+	/* The rest of the last step, if it does not fit, see lintoevs_framein */
+	if (shared->pvt->samples + pvt->samples > ENCODER_BUFFER_SAMPLES(sample_rate)) {
+		shared->pvt->samples = 0;
+	}
+
+	if (apvt->direct) {
+		evs_ring_write(shared->pvt, apvt->direct, pvt->samples);
+	} else {
+		while (pvt->samples) {
+			const int samples = MIN(pvt->samples, n_samples);
+
+			evs_ring_write(shared->pvt, evs_ring_read(pvt, samples), samples);
+			pvt->samples = pvt->samples - samples;
+		}
+	}
+
+	return lintoevs_frameout(shared->pvt);
+}
+
+/* Copies the payloads of the group, with the timing of this translator */
+static struct ast_frame *evs_shared_copy(struct ast_trans_pvt *pvt, struct ast_frame *output)
+{
+	struct ast_frame *result = NULL;
+	struct ast_frame *last = NULL;
+	struct ast_frame *current;
+
+	for (; output; output = AST_LIST_NEXT(output, frame_list)) {
+		current = ast_frdup(output);
+		if (NULL == current) {
+			break;
+		}
+		ast_copy_flags(current, &pvt->f, AST_FRFLAG_HAS_TIMING_INFO);
+		current->ts = pvt->f.ts;
+		current->len = pvt->f.len;
+		current->seqno = pvt->f.seqno;
+		AST_LIST_NEXT(current, frame_list) = NULL;
+		if (last) {
+			AST_LIST_NEXT(last, frame_list) = current;
+		} else {
+			result = current;
+		}
+		last = current;
+	}
+
+	return result;
+}
+
+/*
+ * With the lock of the group: the step of this translator
+ * \retval 1 encoded already, from the same input with the same parameters
+ * \retval 0 to encode next
+ * \retval -1 neither; the group went on with other input
+ */
+static int evs_shared_state(const struct evs_encoder_pvt *apvt, const struct evs_shared *shared,
+	int samples)
+{
+	if (shared->steps == apvt->step + 1) {
+		/* The hash first, then its length and all parameters */
+		return (shared->hash == apvt->step_hash && shared->samples == samples &&
+			!evs_shared_key_cmp(&shared->key, &apvt->key)) ? 1 : -1;
+	}
+
+	return (shared->steps == apvt->step) ? 0 : -1;
+}
+
+/* With the lock of the group: a reference to the output of its last step */
+static struct evs_shared_output *evs_shared_take(struct evs_encoder_pvt *apvt,
+	struct evs_shared *shared)
+{
+	apvt->step = shared->steps;
+	apvt->boundary = shared->boundary;
+
+	return ao2_bump(shared->output);
+}
+
+static struct ast_frame *evs_shared_frameout(struct ast_trans_pvt *pvt)
+{
+	struct evs_encoder_pvt *apvt = pvt->pvt;
+	struct evs_shared *shared;
+	struct evs_shared *left;
+	struct evs_shared_output *output = NULL;
+	struct ast_frame *result = NULL;
+	const int samples = pvt->samples;
+	int fresh;
+	int state;
+	int done = 0;
+
+	if (0 == pvt->samples) {
+		return NULL;
+	}
+
+	/* Groups are per mode; a CMR makes this translator change its group */
+	if (apvt->mailbox) {
+		const unsigned int mode = __atomic_load_n(&apvt->mailbox->mode, __ATOMIC_ACQUIRE);
+
+		if (EVS_NO_REQ != mode) {
+			apvt->mode = mode;
+			apvt->key.mode = mode;
+		}
+	}
+
+	/* Another member might advance the group meanwhile; a new group
+	 * cannot be advanced by others, see evs_shared_find */
+	for (fresh = 0; fresh < 2 && !done; fresh = fresh + 1) {
+		left = NULL;
+		ast_mutex_lock(&evs_shared_lock);
+		shared = evs_shared_find(apvt, fresh);
+		if (shared && shared != apvt->shared) {
+			shared->members = shared->members + 1;
+			evs_shared_calls = evs_shared_calls + 1;
+			if (apvt->shared) {
+				left = evs_shared_leave(apvt->shared);
+			}
+			apvt->shared = shared;
+		}
+		ast_mutex_unlock(&evs_shared_lock);
+		if (left) {
+			evs_shared_destroy(left);
+		}
+		if (NULL == shared) {
+			break;
+		}
+
+		/* Taken from the group, if another member encoded it */
+		ast_mutex_lock(&shared->lock);
+		state = evs_shared_state(apvt, shared, samples);
+		if (0 < state) {
+			output = evs_shared_take(apvt, shared);
+			__atomic_add_fetch(&evs_shared_reused, 1, __ATOMIC_RELAXED);
+			done = 1;
+		}
+		ast_mutex_unlock(&shared->lock);
+		if (state) {
+			continue;
+		}
+
+		/* Encoded by this member; the others wait for it or read the last step */
+		ast_mutex_lock(&shared->encoding);
+		ast_mutex_lock(&shared->lock);
+		state = evs_shared_state(apvt, shared, samples);
+		if (0 < state) {
+			output = evs_shared_take(apvt, shared);
+			__atomic_add_fetch(&evs_shared_reused, 1, __ATOMIC_RELAXED);
+			done = 1;
+		}
+		ast_mutex_unlock(&shared->lock);
+		if (0 == state) {
+			struct evs_shared_output *encoded;
+			struct evs_shared_output *old;
+			struct ast_frame *frames;
+			const int joinable = evs_shared_boundary(shared);
+
+			frames = evs_shared_encode(pvt, shared);
+			encoded = ao2_alloc_options(sizeof(*encoded), evs_shared_output_destroy,
+				AO2_ALLOC_OPT_LOCK_NOLOCK);
+			if (encoded) {
+				encoded->frames = frames;
+			} else if (frames) {
+				ast_frfree(frames);
+			}
+
+			ast_mutex_lock(&shared->lock);
+			__atomic_store_n(&shared->joinable, joinable, __ATOMIC_RELAXED);
+			__atomic_store_n(&shared->prev, shared->hash, __ATOMIC_RELAXED);
+			__atomic_store_n(&shared->hash, apvt->step_hash, __ATOMIC_RELAXED);
+			shared->samples = samples;
+			shared->boundary = evs_shared_boundary(shared);
+			old = shared->output;
+			shared->output = encoded;
+			__atomic_store_n(&shared->steps, shared->steps + 1, __ATOMIC_RELEASE);
+			output = evs_shared_take(apvt, shared);
+			ast_mutex_unlock(&shared->lock);
+
+			ao2_cleanup(old);
+			__atomic_add_fetch(&evs_shared_encoded, 1, __ATOMIC_RELAXED);
+			done = 1;
+		}
+		ast_mutex_unlock(&shared->encoding);
+	}
+
+	/* Outside the locks of the group */
+	if (output) {
+		result = evs_shared_copy(pvt, output->frames);
+		ao2_ref(output, -1);
+	}
+
+	/* The input went into the group, or is dropped */
+	apvt->last_hash = apvt->step_hash;
+	apvt->step_hash = FNV_OFFSET;
+	apvt->step_silent = 1;
+	apvt->direct = NULL;
+	apvt->head = 0;
+	pvt->samples = 0;
+
+	return result;
+}
+
+static struct ast_frame *lintoevs_frameout(struct ast_trans_pvt *pvt)
+{
+	struct evs_encoder_pvt *apvt = pvt->pvt;
+	const unsigned int sample_rate = pvt->t->src_codec.sample_rate;
+	const short n_samples = sample_rate / 50;
+	struct ast_frame *result = NULL;
+	struct ast_frame *last = NULL;
+	int samples = 0; /* Input samples encoded */
+
+	struct evs_attr *attr = ast_format_get_attribute_data(pvt->f.subclass.format);
+	const int cmr = attr ? attr->cmr : 0;
+	const int hf_only = attr ? attr->hf_only : -1;
+
+	if (apvt->async && pvt != &apvt->async->shadow) {
+		return evs_async_frameout(pvt, apvt->async);
+	}
+	if (apvt->shareable) {
+		return evs_shared_frameout(pvt);
+	}
+
+	while (pvt->samples >= n_samples) {
+		struct ast_frame *current;
+		unsigned char *out = pvt->outbuf.uc;
+		const short *in;
+		unsigned char toc;
+		long long start;
+		int bit_rate;
+		int i;
+
+		/* A new payload starts: mode changes apply to all its frames */
+		if (0 == apvt->frames) {
+			if (apvt->mailbox) {
+				const unsigned int mode = __atomic_load_n(&apvt->mailbox->mode, __ATOMIC_ACQUIRE);
+
+				if (EVS_NO_REQ != mode) {
+					apvt->mode = mode;
+				}
+			}
+
+			evs_encoder_set_mode(apvt->encoder, apvt->mode, sample_rate);
+			evs_rate_control_apply(apvt->encoder, &apvt->rc);
+			apvt->cmr = (apvt->encoder->Opt_AMR_WB || 1 == cmr);
+			/* Compact format saves the ToC, see 3GPP TS 26.445 A.2.1;
+			 * AMR-WB IO carries its CMR within, with 3 bits only */
+			apvt->compact = (1 == apvt->frames_per_packet && 1 != hf_only &&
+				(apvt->encoder->Opt_AMR_WB || !apvt->cmr));
+			if (apvt->compact) {
+				apvt->cmr = 0;
+				apvt->datalen = 0;
+			} else {
+				apvt->datalen = apvt->cmr + apvt->frames_per_packet;
+			}
+			apvt->speech = 0;
+		}
+
+		if (apvt->direct) {
+			in = apvt->direct + samples;
+		} else {
+			in = evs_ring_read(pvt, n_samples);
+		}
+		start = evs_now_ns();
+		if (apvt->encoder->Opt_AMR_WB) {
+			amr_wb_enc(apvt->encoder, in, n_samples);
+		} else {
+			evs_enc(apvt->encoder, in, n_samples);
+		}
+		evs_stats_time(&apvt->stats, &evs_encoder_stats, evs_now_ns() - start);
+
+		samples += n_samples;
+		pvt->samples -= n_samples;
+
+		/* Table of Content (ToC), see lib_com/bitstream.c:write_indices */
+		toc = 0x00; /* Header Type identification and Followed bit */
+		toc |= (apvt->encoder->Opt_AMR_WB << 5); /* EVS mode bit */
+		toc |= (apvt->encoder->Opt_AMR_WB << 4); /* Quality bit */
+
+		bit_rate = rate2EVSmode(apvt->encoder->nb_bits_tot * 50);
+		if (bit_rate < 0) {
+			ast_log(LOG_ERROR, "Error encoding the 3GPP EVS frame (code: %d)\n", apvt->encoder->nb_bits_tot);
+			bit_rate = NO_DATA;
+		}
+		toc |= bit_rate;
+		evs_stats_mode(&apvt->stats, &evs_encoder_stats, toc);
+		if (!apvt->compact) {
+			out[apvt->cmr + apvt->frames] = toc;
+		}
+		if (bit_rate != NO_DATA && apvt->encoder->Opt_AMR_WB && apvt->compact) {
+			/* indices_to_serial orders AMR-WB IO as on the wire and appends
+			 * STI and mode indication to SID; Compact has no mode indication */
+			const unsigned int num_bits = 3 + AMRWB_IOmode2rate[bit_rate] / 50 +
+				(AMRWB_IO_SID == bit_rate);
+
+			indices_to_serial(apvt->encoder, apvt->serial, &apvt->encoder->nb_bits_tot);
+			/* CMR with 3 bits: 7 = NO_REQ, see evs_parse_payload */
+			out[0] = 0xe0 | (apvt->serial[0] >> 3);
+			for (i = 1; i < ((num_bits + 7) / 8); i = i + 1) {
+				out[i] = (apvt->serial[i - 1] << 5) | (apvt->serial[i] >> 3);
+			}
+			if (num_bits % 8) { /* padding */
+				out[i - 1] &= 0xff << (8 - num_bits % 8);
+			}
+			apvt->datalen = (num_bits + 7) / 8;
+			apvt->speech = apvt->speech + 1;
+		} else if (bit_rate != NO_DATA) { /* NO_DATA happens in case of DTX */
+			/* Frame: appended after the previous frames */
+			indices_to_serial(apvt->encoder, out + apvt->datalen, &apvt->encoder->nb_bits_tot);
+			/* Convert bits into bytes, +7 is for rounding-up */
+			apvt->datalen = apvt->datalen + ((apvt->encoder->nb_bits_tot + 7) / 8);
+			apvt->speech = apvt->speech + 1;
+		}
+
+		/* Everything used, therefore reset hidden index pointers */
+		reset_indices_enc(apvt->encoder);
+
+		apvt->frames = apvt->frames + 1;
+		if (apvt->frames < apvt->frames_per_packet) {
+			continue;
+		}
+		apvt->frames = 0;
+
+		if (0 == apvt->speech) {
+			continue; /* nothing but NO_DATA, nothing to send */
+		}
+
+		/* Change Mode Request (CMR) */
+		if (apvt->cmr) {
+			out[0] = 0x7f; /* NO_REQ = no change in mode requested */
+			out[0] = out[0] | 0x80; /* Header Type identification bit */
+			evs_stats_count(&apvt->stats.cmr, &evs_encoder_stats.cmr);
+		}
+		/* Followed bit: all but the last ToC */
+		for (i = 0; i < apvt->frames_per_packet - 1; i = i + 1) {
+			out[apvt->cmr + i] |= EVS_FOLLOWED_BIT;
+		}
+		/* Header-Full with the size of a Compact payload gets padded,
+		 * see 3GPP TS 26.445 A.2.3.2 */
+		while (!apvt->compact && 1 != hf_only && 0 <= evs_compact_toc(apvt->datalen)) {
+			out[apvt->datalen] = 0x00;
+			apvt->datalen = apvt->datalen + 1;
+		}
+
+		/* out was and is still part of pvt->outbuf.uc */
+		current = ast_trans_frameout(pvt, apvt->datalen,
+			apvt->frames_per_packet * EVS_SAMPLES);
+
+		if (!current) {
+			continue;
+		} else if (last) {
+			AST_LIST_NEXT(last, frame_list) = current;
+		} else {
+			result = current;
+		}
+		last = current;
+	}
+
+	/* Valid during this translation only; whole frames are used up */
+	apvt->direct = NULL;
+
+	return result;
+}
+
+/*
+ * Output stage of the decoder: from float into 16 bit, rounded and
+ * saturated, with the same result as syn_output of the 3GPP EVS library,
+ * see lib_com/tools.c:mvr2s. The vectorized kernels clamp each sample
+ * plus 0.5 before rounding it down; then the conversion into integer is
+ * exact. The kernel is chosen at load time, see evs_syn_output_init.
+ */
+static void evs_syn_output_c(const float *synth, int n, short *synth_out)
+{
+	int i;
+
+	for (i = 0; i < n; i = i + 1) {
+		float temp = floorf(synth[i] + 0.5f);
+
+		if (temp > 32767.0f) {
+			temp = 32767.0f;
+		} else if (temp < -32768.0f) {
+			temp = -32768.0f;
+		}
+		synth_out[i] = (short) temp;
+	}
+}
+
+#if defined(__SSE2__)
+/* SSE2 has no floor: truncated toward zero, one less if that was above */
+static inline __m128i evs_floor_sse2(__m128 v)
+{
+	const __m128i t = _mm_cvttps_epi32(v);
+
+	return _mm_add_epi32(t, _mm_castps_si128(_mm_cmpgt_ps(_mm_cvtepi32_ps(t), v)));
+}
+
+static void evs_syn_output_sse2(const float *synth, int n, short *synth_out)
+{
+	const __m128 half = _mm_set1_ps(0.5f);
+	const __m128 low = _mm_set1_ps(-32768.0f);
+	const __m128 high = _mm_set1_ps(32767.0f);
+	int i;
+
+	for (i = 0; i + 8 <= n; i = i + 8) {
+		const __m128 a = _mm_add_ps(_mm_loadu_ps(synth + i), half);
+		const __m128 b = _mm_add_ps(_mm_loadu_ps(synth + i + 4), half);
+		const __m128i c = evs_floor_sse2(_mm_min_ps(_mm_max_ps(a, low), high));
+		const __m128i d = evs_floor_sse2(_mm_min_ps(_mm_max_ps(b, low), high));
+
+		_mm_storeu_si128((__m128i *) (synth_out + i), _mm_packs_epi32(c, d));
+	}
+	evs_syn_output_c(synth + i, n - i, synth_out + i);
+}
+#endif
+
+#if defined(__GNUC__) && defined(__x86_64__)
+#define EVS_SYN_OUTPUT_AVX2 1
+__attribute__((target("avx2")))
+static void evs_syn_output_avx2(const float *synth, int n, short *synth_out)
+{
+	const __m256 half = _mm256_set1_ps(0.5f);
+	const __m256 low = _mm256_set1_ps(-32768.0f);
+	const __m256 high = _mm256_set1_ps(32767.0f);
+	int i;
+
+	for (i = 0; i + 16 <= n; i = i + 16) {
+		const __m256 a = _mm256_add_ps(_mm256_loadu_ps(synth + i), half);
+		const __m256 b = _mm256_add_ps(_mm256_loadu_ps(synth + i + 8), half);
+		const __m256i c = _mm256_cvttps_epi32(_mm256_floor_ps(_mm256_min_ps(_mm256_max_ps(a, low), high)));
+		const __m256i d = _mm256_cvttps_epi32(_mm256_floor_ps(_mm256_min_ps(_mm256_max_ps(b, low), high)));
+
+		/* packs works per 128-bit lane: restore the order of the samples */
+		_mm256_storeu_si256((__m256i *) (synth_out + i),
+			_mm256_permute4x64_epi64(_mm256_packs_epi32(c, d), 0xd8));
+	}
+	evs_syn_output_c(synth + i, n - i, synth_out + i);
+}
+#endif
+
+#if defined(__aarch64__) && defined(__ARM_NEON)
+static void evs_syn_output_neon(const float *synth, int n, short *synth_out)
+{
+	const float32x4_t half = vdupq_n_f32(0.5f);
+	const float32x4_t low = vdupq_n_f32(-32768.0f);
+	const float32x4_t high = vdupq_n_f32(32767.0f);
+	int i;
+
+	for (i = 0; i + 8 <= n; i = i + 8) {
+		const float32x4_t a = vaddq_f32(vld1q_f32(synth + i), half);
+		const float32x4_t b = vaddq_f32(vld1q_f32(synth + i + 4), half);
+		const int32x4_t c = vcvtq_s32_f32(vrndmq_f32(vminq_f32(vmaxq_f32(a, low), high)));
+		const int32x4_t d = vcvtq_s32_f32(vrndmq_f32(vminq_f32(vmaxq_f32(b, low), high)));
+
+		vst1q_s16(synth_out + i, vcombine_s16(vqmovn_s32(c), vqmovn_s32(d)));
+	}
+	evs_syn_output_c(synth + i, n - i, synth_out + i);
+}
+#endif
+
+static void (*evs_syn_output)(const float *synth, int n, short *synth_out) = evs_syn_output_c;
+static const char *evs_syn_output_name = "C";
+
+static void evs_syn_output_init(void)
+{
+#if defined(__SSE2__)
+	evs_syn_output = evs_syn_output_sse2;
+	evs_syn_output_name = "SSE2";
+#endif
+#if defined(EVS_SYN_OUTPUT_AVX2)
+	if (__builtin_cpu_supports("avx2")) {
+		evs_syn_output = evs_syn_output_avx2;
+		evs_syn_output_name = "AVX2";
+	}
+#endif
+#if defined(__aarch64__) && defined(__ARM_NEON)
+	evs_syn_output = evs_syn_output_neon;
+	evs_syn_output_name = "NEON";
+#endif
+}
+
+/* Appends the samples of the last decoded frame to the output buffer */
+static void evs_output_frame(struct ast_trans_pvt *pvt)
+{
+	struct evs_decoder_pvt *apvt = pvt->pvt;
+	const short n_samples = pvt->t->dst_codec.sample_rate / 50;
+
+	evs_syn_output(apvt->con, n_samples, pvt->outbuf.i16 + pvt->samples);
+	apvt->bandwidth = MAX(apvt->bandwidth, apvt->decoder->bwidth);
+
+	if (apvt->decoder->ini_frame < MAX_FRAME_COUNTER) {
+		apvt->decoder->ini_frame = apvt->decoder->ini_frame + 1;
+	}
+
+	pvt->samples += n_samples;
+	pvt->datalen += n_samples * 2;
+}
+
+/* Synthesizes one lost frame, appends its samples to the output buffer */
+static void evs_conceal_frame(struct ast_trans_pvt *pvt)
+{
+	struct evs_decoder_pvt *apvt = pvt->pvt;
+	const long long start = evs_now_ns();
+
+	apvt->decoder->bfi = 1; /* Bad frame indicator */
+	if (apvt->decoder->Opt_AMR_WB) {
+		amr_wb_dec(apvt->decoder, apvt->con);
+	} else {
+		evs_dec(apvt->decoder, apvt->con, FRAMEMODE_MISSING);
+	}
+	evs_stats_time(&apvt->stats, &evs_decoder_stats, evs_now_ns() - start);
+	evs_stats_count(&apvt->stats.concealed, &evs_decoder_stats.concealed);
+	evs_output_frame(pvt);
+}
+
+/* Decodes one frame, appends its samples to the output buffer */
+static int evs_decode_frame(struct ast_trans_pvt *pvt, const struct evs_payload_frame *frame)
+{
+	struct evs_decoder_pvt *apvt = pvt->pvt;
+
+	const unsigned char toc_byte = frame->toc;
+	unsigned char *payload = (unsigned char *) frame->data;
+	const frameMode bad_frame = FRAMEMODE_NORMAL;
+	UWord16 core_mode;
+	unsigned int num_bits;
+	long long start;
+
+	evs_stats_mode(&apvt->stats, &evs_decoder_stats, toc_byte);
+	core_mode = toc_byte & EVS_FRAME_TYPE_MASK;
+	if (toc_byte & EVS_MODE_BIT) {
+		apvt->decoder->Opt_AMR_WB = 1;
+	}
+	/* Lost at the sender or damaged on the way (AMR-WB IO Quality bit) */
+	if (EVS_SPEECH_LOST == core_mode ||
+		((toc_byte & EVS_MODE_BIT) && !(toc_byte & EVS_QUALITY_BIT))) {
+		evs_conceal_frame(pvt);
+		return 0;
+	}
+
+	if (toc_byte & EVS_MODE_BIT) {
+		apvt->decoder->bfi = 0;
+		apvt->decoder->total_brate = AMRWB_IOmode2rate[core_mode];
+	} else {
+		apvt->decoder->Opt_AMR_WB = 0;
+		apvt->decoder->bfi = 0; /* Bad frame indicator; ignored for EVS */
+		apvt->decoder->total_brate = PRIMARYmode2rate[core_mode];
+	}
+
+	num_bits = apvt->decoder->total_brate / 50;
+	if (MAX_BITS_PER_FRAME < num_bits) {
+		evs_stats_corrupt(&apvt->stats, &apvt->corrupt_logged, "More bits than a frame can have");
+		return -1;
+	}
+	if (apvt->decoder->Opt_AMR_WB) {
+		if (0 == evs_amr_wb_unsort(apvt->fra, frame, num_bits)) {
+			apvt->decoder->total_brate = 0; /* SID_FIRST */
+		}
+		payload = apvt->fra;
+		/* read_indices_from_djb could be avoided for AMR-WB, which would
+		 * avoid one round of bit-shuffling. However, many flags of the
+		 * decoder state are set by this function. Please, report this as
+		 * issue, if you are affected by this additional bit-shuffling. */
+	}
+	start = evs_now_ns();
+	read_indices_from_djb(apvt->decoder, payload, num_bits, 0, 0);
+
+	if (apvt->decoder->Opt_AMR_WB) {
+		amr_wb_dec(apvt->decoder, apvt->con);
+	} else {
+		evs_dec(apvt->decoder, apvt->con, bad_frame);
+	}
+	evs_stats_time(&apvt->stats, &evs_decoder_stats, evs_now_ns() - start);
+	evs_output_frame(pvt);
+
+	return 0;
+}
+
+/*
+ * Channel-Aware mode (CA) of 13.2 kbps carries a partial copy of the
+ * frame which was sent offset frames before, see 3GPP TS 26.445 5.8.
+ * \retval offset of the partial copy; 0 if none
+ */
+static int evs_partial_copy_offset(const struct evs_payload_frame *frame)
+{
+	short type = RF_NO_DATA;
+	short offset = 0;
+
+	if (NULL == frame->data || (frame->toc & EVS_MODE_BIT) ||
+		PRIMARY_13200 != (frame->toc & EVS_FRAME_TYPE_MASK)) {
+		return 0;
+	}
+
+	evs_dec_previewFrame((unsigned char *) frame->data,
+		PRIMARYmode2rate[PRIMARY_13200] / 50, &type, &offset);
+
+	return (RF_NO_DATA == type) ? 0 : offset;
+}
+
+/* Decodes a lost frame from the partial copy within a future frame */
+static void evs_recover_frame(struct ast_trans_pvt *pvt,
+	const struct evs_payload_frame *future, const struct evs_payload_frame *next)
+{
+	struct evs_decoder_pvt *apvt = pvt->pvt;
+	short next_coder_type = 0;
+
+	/* Coder type of the frame after the lost one, if received */
+	if (next && next->data && !(next->toc & EVS_MODE_BIT) && 0 < evs_toc_bits(next->toc)) {
+		get_NextCoderType((unsigned char *) next->data, &next_coder_type);
+	}
+
+	apvt->decoder->Opt_AMR_WB = 0;
+	apvt->decoder->bfi = 0;
+	apvt->decoder->total_brate = PRIMARYmode2rate[PRIMARY_13200];
+	read_indices_from_djb(apvt->decoder, (unsigned char *) future->data,
+		PRIMARYmode2rate[PRIMARY_13200] / 50, 1, next_coder_type);
+	evs_dec(apvt->decoder, apvt->con, FRAMEMODE_FUTURE);
+	evs_output_frame(pvt);
+}
+
+/* Decodes the oldest frame of the delay line, with its partial copy if lost */
+static int evs_delay_pop(struct ast_trans_pvt *pvt)
+{
+	struct evs_decoder_pvt *apvt = pvt->pvt;
+	const int size = ARRAY_LEN(apvt->delayed);
+	struct evs_delayed_frame *oldest = &apvt->delayed[apvt->delay_first];
+	int i;
+
+	apvt->delay_first = (apvt->delay_first + 1) % size;
+	apvt->delay_count = apvt->delay_count - 1;
+
+	if (oldest->silence) {
+		const short n_samples = pvt->t->dst_codec.sample_rate / 50;
+
+		if (pvt->samples + n_samples <= DECODER_BUFFER_SAMPLES(pvt->t->dst_codec.sample_rate)) {
+			memset(pvt->outbuf.i16 + pvt->samples, 0, n_samples * 2);
+			pvt->samples += n_samples;
+			pvt->datalen += n_samples * 2;
+		}
+		return 0;
+	}
+
+	if (oldest->frame.data &&
+		EVS_SPEECH_LOST != (oldest->frame.toc & EVS_FRAME_TYPE_MASK)) {
+		return evs_decode_frame(pvt, &oldest->frame);
+	}
+
+	/* Lost: search the future frames for its partial copy */
+	for (i = 0; i < apvt->delay_count; i = i + 1) {
+		const struct evs_delayed_frame *future =
+			&apvt->delayed[(apvt->delay_first + i) % size];
+
+		if (!future->silence && evs_partial_copy_offset(&future->frame) == i + 1) {
+			const struct evs_delayed_frame *next = &apvt->delayed[apvt->delay_first];
+
+			ast_debug(4, "Recovering a lost frame from its partial copy (3GPP EVS)\n");
+			evs_recover_frame(pvt, &future->frame, next->silence ? NULL : &next->frame);
+			return 0;
+		}
+	}
+
+	evs_conceal_frame(pvt);
+	return 0;
+}
+
+/* Inserts silence in front of the delay line to hold back more frames */
+static void evs_delay_grow(struct ast_trans_pvt *pvt, int depth)
+{
+	struct evs_decoder_pvt *apvt = pvt->pvt;
+	const int size = ARRAY_LEN(apvt->delayed);
+
+	depth = MIN(depth, MAX_RF_FEC_OFFSET);
+	ast_debug(3, "Holding back %d frame(s) for partial copies (3GPP EVS)\n", depth);
+	while (apvt->delay_depth < depth) {
+		apvt->delay_first = (apvt->delay_first + size - 1) % size;
+		apvt->delayed[apvt->delay_first].silence = 1;
+		apvt->delay_count = apvt->delay_count + 1;
+		apvt->delay_depth = apvt->delay_depth + 1;
+	}
+}
+
+/* Appends a frame to the delay line; NULL if lost */
+static int evs_delay_push(struct ast_trans_pvt *pvt, const struct evs_payload_frame *frame)
+{
+	struct evs_decoder_pvt *apvt = pvt->pvt;
+	const int size = ARRAY_LEN(apvt->delayed);
+	struct evs_delayed_frame *newest =
+		&apvt->delayed[(apvt->delay_first + apvt->delay_count) % size];
+
+	newest->silence = 0;
+	newest->frame.data = NULL;
+	if (frame) {
+		const int bits = evs_toc_bits(frame->toc);
+
+		newest->frame = *frame;
+		if (0 < bits) {
+			memcpy(newest->data, frame->data, (frame->offset + bits + 7) / 8);
+		}
+		newest->frame.data = newest->data;
+	}
+	apvt->delay_count = apvt->delay_count + 1;
+
+	if (apvt->delay_count > apvt->delay_depth) {
+		return evs_delay_pop(pvt);
+	}
+
+	return 0;
+}
+
+/* Conceals up to count frames, as long as they fit into the output buffer
+ * besides the reserved frames */
+static void evs_conceal(struct ast_trans_pvt *pvt, int count, int reserved)
+{
+	struct evs_decoder_pvt *apvt = pvt->pvt;
+	const unsigned int sample_rate = pvt->t->dst_codec.sample_rate;
+	const int space = (DECODER_BUFFER_SAMPLES(sample_rate) - pvt->samples) / (sample_rate / 50) - reserved;
+
+	count = MIN(count, MIN(space, MAX_CONCEALED_FRAMES));
+	ast_debug(4, "Concealing %d lost frame(s) (3GPP EVS)\n", count);
+	while (0 < count) {
+		if (apvt->delay_depth) {
+			evs_delay_push(pvt, NULL); /* might be recovered later */
+		} else {
+			evs_conceal_frame(pvt);
+		}
+		count = count - 1;
+	}
+}
+
+/* Feeds the frames of one payload into the Jitter Buffer Management (JBM) */
+static void evs_jbm_feed(struct ast_trans_pvt *pvt, struct ast_frame *f,
+	const struct evs_payload_frame *frames, int count, unsigned int now)
+{
+	struct evs_decoder_pvt *apvt = pvt->pvt;
+	/* RTP timestamp in 16 kHz, as the payload was sent */
+	const unsigned long timestamp = (ast_test_flag(f, AST_FRFLAG_HAS_TIMING_INFO) ?
+		f->ts : apvt->jbm_fed) * (EVS_SAMPLES / 20);
+	int i;
+
+	for (i = 0; i < count; i = i + 1) {
+		const unsigned char toc_byte = frames[i].toc;
+		const UWord16 core_mode = toc_byte & EVS_FRAME_TYPE_MASK;
+		unsigned char *serial = (unsigned char *) frames[i].data;
+		unsigned int num_bits;
+
+		apvt->jbm_fed = apvt->jbm_fed + 20;
+		evs_stats_mode(&apvt->stats, &evs_decoder_stats, toc_byte);
+
+		/* NO_DATA, lost, and damaged frames are left to the JBM */
+		if (EVS_SPEECH_LOST <= core_mode ||
+			((toc_byte & EVS_MODE_BIT) && !(toc_byte & EVS_QUALITY_BIT))) {
+			continue;
+		}
+
+		if (toc_byte & EVS_MODE_BIT) {
+			num_bits = AMRWB_IOmode2rate[core_mode] / 50;
+			if (0 == evs_amr_wb_unsort(apvt->fra, &frames[i], num_bits)) {
+				continue; /* SID_FIRST */
+			}
+			serial = apvt->fra;
+		} else {
+			num_bits = PRIMARYmode2rate[core_mode] / 50;
+		}
+		if (0 == num_bits || MAX_BITS_PER_FRAME < num_bits) {
+			continue;
+		}
+
+		/* The JBM detects the mode by the number of bits */
+		if (EVS_RX_NO_ERROR != EVS_RX_FeedFrame(apvt->jbm, serial, num_bits,
+				f->seqno, timestamp + i * EVS_SAMPLES, now)) {
+			ast_log(LOG_WARNING, "Error feeding the 3GPP EVS jitter buffer\n");
+		}
+	}
+}
+
+/* Plays out 20 ms per request as far as the wall clock passed */
+static void evs_jbm_playout(struct ast_trans_pvt *pvt, unsigned int now, int fed)
+{
+	struct evs_decoder_pvt *apvt = pvt->pvt;
+	const unsigned int sample_rate = pvt->t->dst_codec.sample_rate;
+	const short n_samples = sample_rate / 50;
+	unsigned int played;
+	unsigned int delay;
+	int requests = 0;
+
+	/* Without payloads, for example in DTX, nothing was requested */
+	if (apvt->jbm_time + JBM_MAX_LEAD < now) {
+		apvt->jbm_time = now - JBM_MAX_LEAD;
+	}
+
+	/* At least one request per payload; otherwise the core complains.
+	 * As long as playout is not too far ahead of the wall clock. */
+	while (apvt->jbm_time + 20 <= now ||
+		(fed && 0 == requests && apvt->jbm_time < now + JBM_MAX_LEAD)) {
+		const int space = DECODER_BUFFER_SAMPLES(sample_rate) - pvt->samples;
+		unsigned int samples = 0;
+		long long start;
+
+		/* Time-scale modification might stretch a frame */
+		if (space < 2 * n_samples) {
+			break;
+		}
+		start = evs_now_ns();
+		if (EVS_RX_NO_ERROR != EVS_RX_GetSamples(apvt->jbm, &samples,
+				pvt->outbuf.i16 + pvt->samples, space, apvt->jbm_time)) {
+			ast_log(LOG_WARNING, "Error reading the 3GPP EVS jitter buffer\n");
+			break;
+		}
+		evs_stats_time(&apvt->stats, &evs_decoder_stats, evs_now_ns() - start);
+		apvt->jbm_time = apvt->jbm_time + 20;
+		apvt->jbm_played = apvt->jbm_played + samples;
+		apvt->bandwidth = MAX(apvt->bandwidth, apvt->decoder->bwidth);
+		pvt->samples += samples;
+		pvt->datalen += samples * 2;
+		requests = requests + 1;
+	}
+
+	/* Approximately, because lost frames were not fed */
+	played = apvt->jbm_played / (sample_rate / 1000);
+	delay = (apvt->jbm_fed > played) ? (apvt->jbm_fed - played) : 0;
+
+	ast_mutex_lock(&evs_jbm_lock);
+	evs_jbm_delay_total = evs_jbm_delay_total - apvt->jbm_delay + delay;
+	ast_mutex_unlock(&evs_jbm_lock);
+	apvt->jbm_delay = delay;
+}
+
+static int evstolin_framein(struct ast_trans_pvt *pvt, struct ast_frame *f)
+{
+	struct evs_decoder_pvt *apvt = pvt->pvt;
+	const unsigned int sample_rate = pvt->t->dst_codec.sample_rate;
+	const short n_samples = sample_rate / 50;
+
+	struct evs_attr *attr = ast_format_get_attribute_data(f->subclass.format);
+	struct evs_payload_frame frames[EVS_MAX_FRAMES];
+	unsigned char cmr;
+	int count;
+	int i;
+
+	evs_stats_internal(pvt, &apvt->stats, f);
+
+	/* The widest bandwidth the other side may send; bw-recv of the call */
+	if (apvt->bandwidth_recv < 0 && attr && (attr->bw_recv & 0x1e)) {
+		static const unsigned int rates[FB + 1] = { 8000, 16000, 32000, 48000 };
+
+		apvt->bandwidth_recv = MIN(FB, floor(log10(attr->bw_recv & 0x1e) / log10(2)) - 1);
+		if (rates[apvt->bandwidth_recv] < sample_rate) {
+			ast_debug(3, "Decoder (3GPP EVS) at %u Hz, bw-recv allows %u Hz only\n",
+				sample_rate, rates[apvt->bandwidth_recv]);
+		}
+	}
+
+	/* Called by the core, not by the worker, see evs_async_run */
+	if (apvt->async && pvt != &apvt->async->shadow) {
+		return evs_async_framein(pvt, apvt->async, f);
+	}
+
+	/* Jitter Buffer Management (JBM): conceals lost frames itself */
+	if (apvt->jbm && 0 == f->datalen) {
+		evs_jbm_playout(pvt, ast_tvdiff_ms(ast_tvnow(), apvt->jbm_start), 0);
+		return 0;
+	}
+
+	/* Native Packet-Loss Concealment (PLC): the jitter buffer interpolates */
+	if (0 == f->datalen) {
+		/* A late payload must not be concealed a second time */
+		apvt->seqno = -1;
+		evs_conceal(pvt, MAX(1, f->samples / EVS_SAMPLES), 0);
+		return 0;
+	}
+
+	/* Compact format: one frame, identified by the size of the payload.
+	 * Header-Full format: CMR (optional), ToC for each frame, then the frames */
+	count = evs_parse_payload(f->data.ptr, f->datalen, attr ? attr->hf_only : -1,
+		&cmr, frames, ARRAY_LEN(frames));
+	if (count < 0) {
+		evs_stats_corrupt(&apvt->stats, &apvt->corrupt_logged, "ToC does not match the payload");
+		return -1;
+	}
+
+	if (cmr != EVS_NO_REQ) {
+		evs_stats_count(&apvt->stats.cmr, &evs_decoder_stats.cmr);
+	}
+	/* For the encoder of this call, see lintoevs_frameout */
+	if (attr && attr->mailbox && cmr != EVS_NO_REQ) {
+		__atomic_store_n(&attr->mailbox->mode, (cmr & ~EVS_HEADER_TYPE_BIT), __ATOMIC_RELEASE);
+	}
+
+	if (apvt->jbm) {
+		const unsigned int now = ast_tvdiff_ms(ast_tvnow(), apvt->jbm_start);
+
+		evs_jbm_feed(pvt, f, frames, count, now);
+		evs_jbm_playout(pvt, now, 1);
+		return 0;
+	}
+
+	if (pvt->samples + count * n_samples > DECODER_BUFFER_SAMPLES(sample_rate)) {
+		ast_log(LOG_WARNING, "Out of buffer space\n");
+		return -1;
+	}
+
+	/* Channel-Aware mode (CA): with ch-aw-recv=2, 3, 5, or 7 from the start,
+	 * otherwise as soon as the first partial copy arrives; -1 is off */
+	if (attr && -1 != attr->ch_aw_recv) {
+		int depth = evs_rf_fec_offset(attr->ch_aw_recv);
+
+		for (i = 0; i < count; i = i + 1) {
+			depth = MAX(depth, evs_partial_copy_offset(&frames[i]));
+		}
+		if (apvt->delay_depth < depth) {
+			evs_delay_grow(pvt, depth);
+		}
+	}
+
+	/* Gap in the RTP sequence numbers: each lost payload is assumed to
+	 * have as many frames as the last one. Reordered payloads are decoded
+	 * as they are, because their gap was concealed already */
+	if (0 > apvt->seqno) {
+		apvt->seqno = (f->seqno + 1) & 0xffff;
+	} else {
+		const unsigned short lost = (f->seqno - apvt->seqno) & 0xffff;
+
+		if (lost < 0x8000) {
+			if (0 < lost) {
+				evs_conceal(pvt, MIN(lost, MAX_CONCEALED_FRAMES) * apvt->frames, count);
+			}
+			apvt->seqno = (f->seqno + 1) & 0xffff;
+		}
+	}
+	apvt->frames = count;
+
+	for (i = 0; i < count; i = i + 1) {
+		if (apvt->delay_depth) {
+			if (evs_delay_push(pvt, &frames[i])) {
+				return -1;
+			}
+		} else if (evs_decode_frame(pvt, &frames[i])) {
+			return -1;
+		}
+	}
+
+	return 0;
+}
+
+/* Without async_workers, this is what the core does by default */
+static struct ast_frame *evstolin_frameout(struct ast_trans_pvt *pvt)
+{
+	struct evs_decoder_pvt *apvt = pvt->pvt;
+
+	if (apvt->async && pvt != &apvt->async->shadow) {
+		return evs_async_frameout(pvt, apvt->async);
+	}
+
+	return ast_trans_frameout(pvt, 0, 0);
+}
+
+static void lintoevs_destroy(struct ast_trans_pvt *pvt)
+{
+	struct evs_encoder_pvt *apvt = pvt->pvt;
+
+	if (NULL == apvt || NULL == apvt->encoder) {
+		return;
+	}
+
+	if (apvt->async) {
+		evs_async_destroy(apvt->async);
+	}
+
+	if (apvt->shared) {
+		struct evs_shared *left;
+
+		ast_mutex_lock(&evs_shared_lock);
+		left = evs_shared_leave(apvt->shared);
+		ast_mutex_unlock(&evs_shared_lock);
+		if (left) {
+			evs_shared_destroy(left);
+		}
+	}
+
+	/* A member encoded nothing itself; its group reports */
+	if (NULL == apvt->shared) {
+		evs_stats_summary(pvt, &apvt->stats, pvt->t->src_codec.sample_rate);
+	}
+	__atomic_sub_fetch(&evs_encoder_stats.state, apvt->stats.state, __ATOMIC_RELAXED);
+	__atomic_sub_fetch(&evs_encoders_active, 1, __ATOMIC_RELAXED);
+
+	ao2_cleanup(apvt->mailbox);
+	evs_encoder_put(apvt->encoder);
+
+	ast_debug(3, "Destroyed encoder (3GPP EVS)\n");
+}
+
+static void evstolin_destroy(struct ast_trans_pvt *pvt)
+{
+	struct evs_decoder_pvt *apvt = pvt->pvt;
+
+	if (NULL == apvt || NULL == apvt->decoder) {
+		return;
+	}
+
+	if (apvt->async) {
+		evs_async_destroy(apvt->async);
+	}
+
+	if (apvt->jbm) {
+		ast_debug(3, "Jitter buffer (3GPP EVS) delay was %u ms\n", apvt->jbm_delay);
+		EVS_RX_Close(&apvt->jbm);
+		ast_mutex_lock(&evs_jbm_lock);
+		evs_jbm_sessions = evs_jbm_sessions - 1;
+		evs_jbm_delay_total = evs_jbm_delay_total - apvt->jbm_delay;
+		ast_mutex_unlock(&evs_jbm_lock);
+	}
+
+	/* Sample rate required by the bandwidth: NB, WB, SWB, and FB; the
+	 * decoded one, limited by what bw-recv allows */
+	if (0 <= apvt->bandwidth && apvt->bandwidth <= FB) {
+		static const unsigned int rates[FB + 1] = { 8000, 16000, 32000, 48000 };
+		const unsigned int sample_rate = pvt->t->dst_codec.sample_rate;
+		const short required = (0 <= apvt->bandwidth_recv) ?
+			MIN(apvt->bandwidth, apvt->bandwidth_recv) : apvt->bandwidth;
+
+		__atomic_add_fetch(&evs_decoders_done, 1, __ATOMIC_RELAXED);
+		if (rates[required] < sample_rate) {
+			__atomic_add_fetch(&evs_decoders_oversampled, 1, __ATOMIC_RELAXED);
+			ast_debug(3, "Decoder (3GPP EVS) at %u Hz, bandwidth requires %u Hz only\n",
+				sample_rate, rates[required]);
+		}
+	}
+
+	evs_stats_summary(pvt, &apvt->stats, pvt->t->dst_codec.sample_rate);
+	__atomic_sub_fetch(&evs_decoder_stats.state, apvt->stats.state, __ATOMIC_RELAXED);
+	__atomic_sub_fetch(&evs_decoders_active, 1, __ATOMIC_RELAXED);
+
+	evs_decoder_put(apvt->decoder);
+
+	ast_debug(3, "Destroyed decoder (3GPP EVS)\n");
+}
+
+/*
+ * Repacketizer between EVS AMR-WB IO and AMR-WB, see RFC 4867 and 3GPP
+ * TS 26.445 A.2: both carry the speech bits in the same order, therefore
+ * only the headers change and the frames get (un)aligned. A payload with
+ * EVS primary frames cannot be repacketized; it goes through a path
+ * evs, slin16, amrwb which the core builds, like for any other call
+ * between the two codecs, see evs_amrwb_transcode.
+ */
+#define AMRWB_MAX_BYTES ((AMRWB_IO_MAX_BITS + 7) / 8)
+#define AMRWB_NO_REQ    15              /* CMR: no change in mode requested */
+
+struct evs_amrwb_pvt {
+	int octet_align;                    /* see codecs.conf [evs] */
+	unsigned char mode_indication;      /* of the last speech frame */
+	/* EVS primary mode: created on the first such payload */
+	struct ast_trans_pvt *decoder;      /* evs to slin16 */
+	struct ast_trans_pvt *encoder;      /* slin16 to amrwb */
+	struct ast_frame *transcoded;       /* their output, see evstoamrwb_frameout */
+	struct evs_stats stats;             /* payloads dropped only */
+	struct timeval corrupt_logged;
+};
+
+static unsigned int evs_get_bits(const unsigned char *data, unsigned int *pos, int count)
+{
+	unsigned int value = 0;
+
+	while (0 < count--) {
+		value = (value << 1) | ((data[*pos / 8] >> (7 - (*pos % 8))) & 1);
+		*pos = *pos + 1;
+	}
+
+	return value;
+}
+
+/* data has to be cleared before */
+static void evs_put_bits(unsigned char *data, unsigned int *pos, unsigned int value, int count)
+{
+	while (0 < count--) {
+		data[*pos / 8] |= ((value >> count) & 1) << (7 - (*pos % 8));
+		*pos = *pos + 1;
+	}
+}
+
+static void evs_copy_bits(unsigned char *dst, unsigned int *dst_pos,
+	const unsigned char *src, unsigned int src_pos, int count)
+{
+	while (0 < count--) {
+		evs_put_bits(dst, dst_pos, evs_get_bits(src, &src_pos, 1), 1);
+	}
+}
+
+static int evs_amrwb_new(struct ast_trans_pvt *pvt)
+{
+	struct evs_amrwb_pvt *apvt = pvt->pvt;
+
+	apvt->octet_align = evs_amrwb_octet_align;
+	apvt->mode_indication = AMRWB_IO_1265;
+
+	ast_debug(3, "Created repacketizer (3GPP EVS, AMR-WB %s)\n",
+		apvt->octet_align ? "octet-aligned" : "bandwidth-efficient");
+	return 0;
+}
+
+/* Passes a payload through the paths evs to slin16 and slin16 to amrwb */
+static int evs_amrwb_transcode(struct ast_trans_pvt *pvt, struct ast_frame *f)
+{
+	struct evs_amrwb_pvt *apvt = pvt->pvt;
+	struct ast_frame *last = apvt->transcoded;
+	struct ast_frame *pcm;
+	struct ast_frame *current;
+
+	if (NULL == apvt->decoder || NULL == apvt->encoder) {
+		struct ast_format *amrwb = pvt->explicit_dst ? ao2_bump(pvt->explicit_dst) :
+			ast_format_cache_get("amrwb");
+
+		if (amrwb && NULL == apvt->decoder) {
+			apvt->decoder = ast_translator_build_path(ast_format_slin16, f->subclass.format);
+		}
+		if (amrwb && NULL == apvt->encoder) {
+			apvt->encoder = ast_translator_build_path(amrwb, ast_format_slin16);
+		}
+		ao2_cleanup(amrwb);
+		if (NULL == apvt->decoder || NULL == apvt->encoder) {
+			ast_log(LOG_ERROR, "No translator path for EVS primary mode towards AMR-WB\n");
+			return -1;
+		}
+		ast_debug(3, "EVS primary mode towards AMR-WB; transcoding\n");
+	}
+
+	while (last && AST_LIST_NEXT(last, frame_list)) {
+		last = AST_LIST_NEXT(last, frame_list);
+	}
+
+	pcm = ast_translate(apvt->decoder, f, 0);
+	for (current = pcm; current; current = AST_LIST_NEXT(current, frame_list)) {
+		struct ast_frame *out = ast_translate(apvt->encoder, current, 0);
+		struct ast_frame *next;
+
+		for (; out; out = next) {
+			struct ast_frame *copy = ast_frdup(out);
+
+			next = AST_LIST_NEXT(out, frame_list);
+			if (NULL == copy) {
+				continue;
+			}
+			AST_LIST_NEXT(copy, frame_list) = NULL;
+			if (last) {
+				AST_LIST_NEXT(last, frame_list) = copy;
+			} else {
+				apvt->transcoded = copy;
+			}
+			last = copy;
+		}
+	}
+	if (pcm) {
+		ast_frfree(pcm);
+	}
+
+	return 0;
+}
+
+static int evstoamrwb_framein(struct ast_trans_pvt *pvt, struct ast_frame *f)
+{
+	struct evs_amrwb_pvt *apvt = pvt->pvt;
+	struct evs_attr *attr = ast_format_get_attribute_data(f->subclass.format);
+	const struct ast_frame *sample;
+	struct evs_payload_frame frames[EVS_MAX_FRAMES];
+	unsigned char types[EVS_MAX_FRAMES]; /* FT and Q, as in the ToC */
+	unsigned char *out = pvt->outbuf.uc;
+	unsigned int pos = 0;
+	unsigned char cmr;
+	int count;
+	int i;
+
+	if (0 == f->datalen) {
+		return 0;
+	}
+
+	count = evs_parse_payload(f->data.ptr, f->datalen, attr ? attr->hf_only : -1,
+		&cmr, frames, ARRAY_LEN(frames));
+	if (count < 0) {
+		evs_stats_corrupt(&apvt->stats, &apvt->corrupt_logged, "ToC does not match the payload");
+		return -1;
+	}
+
+	/* The cost computation of the core sends a primary frame; a path
+	 * built meanwhile would wait for the lock of the translators */
+	sample = pvt->t->sample ? pvt->t->sample() : NULL;
+	for (i = 0; i < count; i = i + 1) {
+		if (!(frames[i].toc & EVS_MODE_BIT) && 0 < evs_toc_bits(frames[i].toc) &&
+			(NULL == sample || sample->data.ptr != f->data.ptr)) {
+			return evs_amrwb_transcode(pvt, f);
+		}
+	}
+
+	for (i = 0; i < count; i = i + 1) {
+		const unsigned char core_mode = frames[i].toc & EVS_FRAME_TYPE_MASK;
+
+		if (frames[i].toc & EVS_MODE_BIT) {
+			types[i] = (core_mode << 1) | !!(frames[i].toc & EVS_QUALITY_BIT);
+			if (core_mode < AMRWB_IO_SID) {
+				apvt->mode_indication = core_mode;
+			}
+		} else if (0 < evs_toc_bits(frames[i].toc)) {
+			types[i] = (EVS_NO_DATA << 1) | 1; /* the sample, see above */
+		} else { /* SPEECH_LOST or NO_DATA */
+			types[i] = (core_mode << 1) | (EVS_NO_DATA == core_mode);
+		}
+	}
+
+	memset(out, 0, pvt->t->buf_size);
+
+	/* Change-Mode Request (CMR): only AMR-WB IO modes pass */
+	if (EVS_NO_REQ != cmr && 0x10 == (cmr & 0x70) && (cmr & 0x0f) <= AMRWB_IO_2385) {
+		evs_put_bits(out, &pos, cmr & 0x0f, 4);
+	} else {
+		evs_put_bits(out, &pos, AMRWB_NO_REQ, 4);
+	}
+	if (apvt->octet_align) {
+		pos = 8;
+	}
+
+	/* Table of Contents (ToC): F, FT, and Q */
+	for (i = 0; i < count; i = i + 1) {
+		evs_put_bits(out, &pos, (i < count - 1), 1);
+		evs_put_bits(out, &pos, types[i], 5);
+		if (apvt->octet_align) {
+			pos = (pos + 7) & ~7;
+		}
+	}
+
+	for (i = 0; i < count; i = i + 1) {
+		int bits = evs_toc_bits(EVS_MODE_BIT | (types[i] >> 1));
+
+		/* Compact SID lacks the mode indication (4 bits) */
+		if (frames[i].offset && AMRWB_IO_SID == (types[i] >> 1)) {
+			evs_copy_bits(out, &pos, frames[i].data, frames[i].offset, bits - 4);
+			evs_put_bits(out, &pos, apvt->mode_indication, 4);
+		} else {
+			evs_copy_bits(out, &pos, frames[i].data, frames[i].offset, bits);
+		}
+		if (apvt->octet_align) {
+			pos = (pos + 7) & ~7;
+		}
+	}
+
+	pvt->datalen = (pos + 7) / 8;
+	pvt->samples = count * EVS_SAMPLES;
+
+	return 0;
+}
+
+/* Output of the repacketizer, or of the paths for EVS primary mode */
+static struct ast_frame *evstoamrwb_frameout(struct ast_trans_pvt *pvt)
+{
+	struct evs_amrwb_pvt *apvt = pvt->pvt;
+	struct ast_frame *result = apvt->transcoded;
+
+	if (result) {
+		apvt->transcoded = NULL;
+		return result;
+	}
+
+	/* As without frameout */
+	return ast_trans_frameout(pvt, 0, 0);
+}
+
+static int amrwbtoevs_framein(struct ast_trans_pvt *pvt, struct ast_frame *f)
+{
+	struct evs_amrwb_pvt *apvt = pvt->pvt;
+	struct evs_attr *attr = ast_format_get_attribute_data(pvt->f.subclass.format);
+	const int hf_only = attr ? attr->hf_only : -1;
+	const unsigned char *in = f->data.ptr;
+	const unsigned int in_bits = f->datalen * 8;
+	unsigned int frames[EVS_MAX_FRAMES]; /* bit position in the input */
+	unsigned char types[EVS_MAX_FRAMES];
+	unsigned char *out = pvt->outbuf.uc;
+	unsigned int pos = 0;
+	unsigned int cmr;
+	int datalen;
+	int count = 0;
+	int i;
+
+	if (in_bits < 4) {
+		return 0;
+	}
+
+	cmr = evs_get_bits(in, &pos, 4);
+	if (apvt->octet_align) {
+		pos = 8;
+	}
+
+	/* Table of Contents (ToC): F, FT, and Q */
+	do {
+		if (count == ARRAY_LEN(types) || in_bits < pos + 6) {
+			evs_stats_corrupt(&apvt->stats, &apvt->corrupt_logged, "ToC does not match the payload");
+			return -1;
+		}
+		types[count] = evs_get_bits(in, &pos, 6);
+		if (apvt->octet_align) {
+			pos = (pos + 7) & ~7;
+		}
+		count = count + 1;
+	} while (types[count - 1] & 0x20);
+
+	for (i = 0; i < count; i = i + 1) {
+		const int bits = evs_toc_bits(EVS_MODE_BIT | ((types[i] >> 1) & EVS_FRAME_TYPE_MASK));
+
+		if (bits < 0 || in_bits < pos + bits) {
+			evs_stats_corrupt(&apvt->stats, &apvt->corrupt_logged, "ToC does not match the payload");
+			return -1;
+		}
+		frames[i] = pos;
+		pos = pos + bits;
+		if (apvt->octet_align) {
+			pos = (pos + 7) & ~7;
+		}
+	}
+
+	/* Header-Full format; AMR-WB IO carries a CMR always */
+	out[0] = (cmr <= AMRWB_IO_2385) ? (0x90 | cmr) : EVS_NO_REQ;
+	datalen = 1 + count;
+	for (i = 0; i < count; i = i + 1) {
+		const unsigned char core_mode = (types[i] >> 1) & EVS_FRAME_TYPE_MASK;
+		const int bits = evs_toc_bits(EVS_MODE_BIT | core_mode);
+
+		out[1 + i] = EVS_MODE_BIT | core_mode;
+		if (types[i] & 0x01) {
+			out[1 + i] |= EVS_QUALITY_BIT;
+		}
+		if (i < count - 1) {
+			out[1 + i] |= EVS_FOLLOWED_BIT;
+		}
+
+		pos = datalen * 8;
+		memset(out + datalen, 0, (bits + 7) / 8);
+		evs_copy_bits(out, &pos, in, frames[i], bits);
+		datalen = datalen + (bits + 7) / 8;
+	}
+	/* Header-Full with the size of a Compact payload gets padded,
+	 * see 3GPP TS 26.445 A.2.3.2 */
+	while (1 != hf_only && 0 <= evs_compact_toc(datalen)) {
+		out[datalen] = 0x00;
+		datalen = datalen + 1;
+	}
+
+	pvt->datalen = datalen;
+	pvt->samples = count * EVS_SAMPLES;
+
+	return 0;
+}
+
+static void evs_amrwb_destroy(struct ast_trans_pvt *pvt)
+{
+	struct evs_amrwb_pvt *apvt = pvt->pvt;
+
+	if (NULL == apvt) {
+		return;
+	}
+
+	if (apvt->transcoded) {
+		ast_frfree(apvt->transcoded);
+	}
+	if (apvt->decoder) {
+		ast_translator_free_path(apvt->decoder);
+	}
+	if (apvt->encoder) {
+		ast_translator_free_path(apvt->encoder);
+	}
+
+	ast_debug(3, "Destroyed repacketizer (3GPP EVS, AMR-WB)\n");
+}
+
+/*
+ * Table costs: the higher the sample rate, the cheaper, so a path via
+ * slin keeps the bandwidth of SWB and FB. With codecs.conf [evs]
+ * prefer_16khz, see evs_table_costs_16khz.
+ */
+static struct ast_translator evstolin = {
+	.table_cost = AST_TRANS_COST_LY_LL_ORIGSAMP,
+	.name = "evstolin",
+	.src_codec = {
+		.name = "evs",
+		.type = AST_MEDIA_TYPE_AUDIO,
+		.sample_rate = 16000,
+	},
+	.dst_codec = {
+		.name = "slin",
+		.type = AST_MEDIA_TYPE_AUDIO,
+		.sample_rate = 8000,
+	},
+	.format = "slin",
+	.newpvt = evstolin_new,
+	.framein = evstolin_framein,
+	.frameout = evstolin_frameout,
+	.destroy = evstolin_destroy,
+	.native_plc = 1,
+	.sample = evs_sample,
+	.desc_size = DECODER_DESC_SIZE(8000),
+	/* The core compares it with the samples of the payload (16 kHz) */
+	.buffer_samples = DECODER_BUFFER_SAMPLES(16000),
+	.buf_size = DECODER_BUFFER_SAMPLES(8000) * sizeof(short),
+};
+
+static struct ast_translator lintoevs = {
+	.table_cost = AST_TRANS_COST_LL_LY_ORIGSAMP,
+	.name = "lintoevs",
+	.src_codec = {
+		.name = "slin",
+		.type = AST_MEDIA_TYPE_AUDIO,
+		.sample_rate = 8000,
+	},
+	.dst_codec = {
+		.name = "evs",
+		.type = AST_MEDIA_TYPE_AUDIO,
+		.sample_rate = 16000,
+	},
+	.format = "evs",
+	.newpvt = lintoevs_new,
+	.framein = lintoevs_framein,
+	.frameout = lintoevs_frameout,
+	.feedback = lintoevs_feedback,
+	.destroy = lintoevs_destroy,
+	.sample = slin8_sample,
+	.desc_size = ENCODER_DESC_SIZE(8000),
+	.buffer_samples = ENCODER_BUFFER_SAMPLES(8000),
+	.buf_size = ENCODER_PAYLOAD_BYTES,
+};
+
+static struct ast_translator evstolin16 = {
+	.table_cost = AST_TRANS_COST_LY_LL_ORIGSAMP - 1,
+	.name = "evstolin16",
+	.src_codec = {
+		.name = "evs",
+		.type = AST_MEDIA_TYPE_AUDIO,
+		.sample_rate = 16000,
+	},
+	.dst_codec = {
+		.name = "slin",
+		.type = AST_MEDIA_TYPE_AUDIO,
+		.sample_rate = 16000,
+	},
+	.format = "slin16",
+	.newpvt = evstolin_new,
+	.framein = evstolin_framein,
+	.frameout = evstolin_frameout,
+	.destroy = evstolin_destroy,
+	.native_plc = 1,
+	.sample = evs_sample,
+	.desc_size = DECODER_DESC_SIZE(16000),
+	.buffer_samples = DECODER_BUFFER_SAMPLES(16000),
+	.buf_size = DECODER_BUFFER_SAMPLES(16000) * sizeof(short),
+};
+
+static struct ast_translator lin16toevs = {
+	.table_cost = AST_TRANS_COST_LL_LY_ORIGSAMP - 1,
+	.name = "lin16toevs",
+	.src_codec = {
+		.name = "slin",
+		.type = AST_MEDIA_TYPE_AUDIO,
+		.sample_rate = 16000,
+	},
+	.dst_codec = {
+		.name = "evs",
+		.type = AST_MEDIA_TYPE_AUDIO,
+		.sample_rate = 16000,
+	},
+	.format = "evs",
+	.newpvt = lintoevs_new,
+	.framein = lintoevs_framein,
+	.frameout = lintoevs_frameout,
+	.feedback = lintoevs_feedback,
+	.destroy = lintoevs_destroy,
+	.sample = slin16_sample,
+	.desc_size = ENCODER_DESC_SIZE(16000),
+	.buffer_samples = ENCODER_BUFFER_SAMPLES(16000),
+	.buf_size = ENCODER_PAYLOAD_BYTES,
+};
+
+static struct ast_translator evstolin32 = {
+	.table_cost = AST_TRANS_COST_LY_LL_ORIGSAMP - 2,
+	.name = "evstolin32",
+	.src_codec = {
+		.name = "evs",
+		.type = AST_MEDIA_TYPE_AUDIO,
+		.sample_rate = 16000,
+	},
+	.dst_codec = {
+		.name = "slin",
+		.type = AST_MEDIA_TYPE_AUDIO,
+		.sample_rate = 32000,
+	},
+	.format = "slin32",
+	.newpvt = evstolin_new,
+	.framein = evstolin_framein,
+	.frameout = evstolin_frameout,
+	.destroy = evstolin_destroy,
+	.native_plc = 1,
+	.sample = evs_sample,
+	.desc_size = DECODER_DESC_SIZE(32000),
+	.buffer_samples = DECODER_BUFFER_SAMPLES(32000),
+	.buf_size = DECODER_BUFFER_SAMPLES(32000) * sizeof(short),
+};
+
+static struct ast_translator lin32toevs = {
+	.table_cost = AST_TRANS_COST_LL_LY_ORIGSAMP - 2,
+	.name = "lin32toevs",
+	.src_codec = {
+		.name = "slin",
+		.type = AST_MEDIA_TYPE_AUDIO,
+		.sample_rate = 32000,
+	},
+	.dst_codec = {
+		.name = "evs",
+		.type = AST_MEDIA_TYPE_AUDIO,
+		.sample_rate = 16000,
+	},
+	.format = "evs",
+	.newpvt = lintoevs_new,
+	.framein = lintoevs_framein,
+	.frameout = lintoevs_frameout,
+	.feedback = lintoevs_feedback,
+	.destroy = lintoevs_destroy,
+	.desc_size = ENCODER_DESC_SIZE(32000),
+	.buffer_samples = ENCODER_BUFFER_SAMPLES(32000),
+	.buf_size = ENCODER_PAYLOAD_BYTES,
+};
+
+static struct ast_translator evstolin48 = {
+	.table_cost = AST_TRANS_COST_LY_LL_ORIGSAMP - 4,
+	.name = "evstolin48",
+	.src_codec = {
+		.name = "evs",
+		.type = AST_MEDIA_TYPE_AUDIO,
+		.sample_rate = 16000,
+	},
+	.dst_codec = {
+		.name = "slin",
+		.type = AST_MEDIA_TYPE_AUDIO,
+		.sample_rate = 48000,
+	},
+	.format = "slin48",
+	.newpvt = evstolin_new,
+	.framein = evstolin_framein,
+	.frameout = evstolin_frameout,
+	.destroy = evstolin_destroy,
+	.native_plc = 1,
+	.sample = evs_sample,
+	.desc_size = DECODER_DESC_SIZE(48000),
+	.buffer_samples = DECODER_BUFFER_SAMPLES(48000),
+	.buf_size = DECODER_BUFFER_SAMPLES(48000) * sizeof(short),
+};
+
+static struct ast_translator lin48toevs = {
+	.table_cost = AST_TRANS_COST_LL_LY_ORIGSAMP - 4,
+	.name = "lin48toevs",
+	.src_codec = {
+		.name = "slin",
+		.type = AST_MEDIA_TYPE_AUDIO,
+		.sample_rate = 48000,
+	},
+	.dst_codec = {
+		.name = "evs",
+		.type = AST_MEDIA_TYPE_AUDIO,
+		.sample_rate = 16000,
+	},
+	.format = "evs",
+	.newpvt = lintoevs_new,
+	.framein = lintoevs_framein,
+	.frameout = lintoevs_frameout,
+	.feedback = lintoevs_feedback,
+	.destroy = lintoevs_destroy,
+	.desc_size = ENCODER_DESC_SIZE(48000),
+	.buffer_samples = ENCODER_BUFFER_SAMPLES(48000),
+	.buf_size = ENCODER_PAYLOAD_BYTES,
+};
+
+static struct ast_translator evstoamrwb = {
+	.table_cost = AST_TRANS_COST_LY_LY_ORIGSAMP,
+	.name = "evstoamrwb",
+	.src_codec = {
+		.name = "evs",
+		.type = AST_MEDIA_TYPE_AUDIO,
+		.sample_rate = 16000,
+	},
+	.dst_codec = {
+		.name = "amrwb",
+		.type = AST_MEDIA_TYPE_AUDIO,
+		.sample_rate = 16000,
+	},
+	.format = "amrwb",
+	.newpvt = evs_amrwb_new,
+	.framein = evstoamrwb_framein,
+	.frameout = evstoamrwb_frameout,
+	.destroy = evs_amrwb_destroy,
+	.sample = evs_sample,
+	.desc_size = sizeof(struct evs_amrwb_pvt),
+	.buffer_samples = EVS_MAX_FRAMES * EVS_SAMPLES,
+	.buf_size = 1 + EVS_MAX_FRAMES * (1 + AMRWB_MAX_BYTES),
+};
+
+static struct ast_translator amrwbtoevs = {
+	.table_cost = AST_TRANS_COST_LY_LY_ORIGSAMP,
+	.name = "amrwbtoevs",
+	.src_codec = {
+		.name = "amrwb",
+		.type = AST_MEDIA_TYPE_AUDIO,
+		.sample_rate = 16000,
+	},
+	.dst_codec = {
+		.name = "evs",
+		.type = AST_MEDIA_TYPE_AUDIO,
+		.sample_rate = 16000,
+	},
+	.format = "evs",
+	.newpvt = evs_amrwb_new,
+	.framein = amrwbtoevs_framein,
+	.destroy = evs_amrwb_destroy,
+	.desc_size = sizeof(struct evs_amrwb_pvt),
+	.buffer_samples = EVS_MAX_FRAMES * EVS_SAMPLES,
+	/* +1: padding against the size of a Compact payload */
+	.buf_size = 1 + EVS_MAX_FRAMES * (1 + AMRWB_MAX_BYTES) + 1,
+};
+
+/*
+ * EVS has 16 kHz in the core, see codec_evs.patch. Other sample rates get
+ * costlier, so the core does not choose 48 kHz for a bridge or mixer;
+ * those process a third of the samples then. However, a path via slin
+ * limits SWB and FB to WB then, even when a call carries SWB or FB.
+ * 32 kHz and 48 kHz are still used when the other side requires them;
+ * the path has one step then.
+ */
+static void evs_table_costs_16khz(void)
+{
+	evstolin.table_cost = AST_TRANS_COST_LY_LL_DOWNSAMP;
+	lintoevs.table_cost = AST_TRANS_COST_LL_LY_UPSAMP;
+	evstolin16.table_cost = AST_TRANS_COST_LY_LL_ORIGSAMP;
+	lin16toevs.table_cost = AST_TRANS_COST_LL_LY_ORIGSAMP;
+	evstolin32.table_cost = AST_TRANS_COST_LY_LL_UPSAMP;
+	lin32toevs.table_cost = AST_TRANS_COST_LL_LY_DOWNSAMP;
+	evstolin48.table_cost = AST_TRANS_COST_LY_LL_UPSAMP;
+	lin48toevs.table_cost = AST_TRANS_COST_LL_LY_DOWNSAMP;
+}
+
+/* Each frame is 20 ms, including NO_DATA and SPEECH_LOST */
+static int evs_sample_counter(struct ast_frame *frame)
+{
+	struct evs_attr *attr = ast_format_get_attribute_data(frame->subclass.format);
+	struct evs_payload_frame frames[EVS_MAX_FRAMES];
+	unsigned char cmr;
+	int count;
+
+	if (0 == frame->datalen) {
+		return 0;
+	}
+
+	/* The result of the SDP negotiation is in the format, if any. Without
+	 * hf-only=1, the Compact format is identified by its size, because a
+	 * Header-Full payload of the same size is padded, see
+	 * 3GPP TS 26.445 A.2.3.2 */
+	count = evs_parse_payload(frame->data.ptr, frame->datalen,
+		attr ? attr->hf_only : -1, &cmr, frames, ARRAY_LEN(frames));
+	if (count < 0) {
+		return EVS_SAMPLES; /* corrupted; the decoder reports it */
+	}
+
+	return count * EVS_SAMPLES;
+}
+
+#ifdef TEST_FRAMEWORK
+AST_TEST_DEFINE(evs_syn_output_test)
+{
+	float synth[FRAME_SAMPLES(48000)];
+	short expected[FRAME_SAMPLES(48000)];
+	short actual[FRAME_SAMPLES(48000)];
+	const int rounds = 10000;
+	struct timeval start;
+	int64_t library;
+	int64_t kernel;
+	int i;
+
+	switch (cmd) {
+	case TEST_INIT:
+		info->name = "syn_output";
+		info->category = "/codecs/evs/";
+		info->summary = "Output stage of the decoder";
+		info->description =
+			"Compares the vectorized output stage with syn_output of the "
+			"3GPP EVS library, and measures both with 48 kHz frames.";
+		return AST_TEST_NOT_RUN;
+	case TEST_EXECUTE:
+		break;
+	}
+
+	/* Beyond both limits, and halves which round differently */
+	for (i = 0; i < ARRAY_LEN(synth); i = i + 1) {
+		synth[i] = (i % 2 ? 0.5f : -0.5f) * (i % 7) + (ast_random() % 90000) - 45000;
+	}
+	synth[0] = 32766.5f;
+	synth[1] = 32767.5f;
+	synth[2] = -32768.5f;
+	synth[3] = -32769.0f;
+	synth[4] = -0.5f;
+	synth[5] = -1.5f;
+
+	syn_output(synth, ARRAY_LEN(synth), expected);
+	for (i = 1; i <= ARRAY_LEN(synth); i = i + 1) {
+		memset(actual, 0, sizeof(actual));
+		evs_syn_output(synth, i, actual);
+		if (memcmp(expected, actual, i * sizeof(actual[0]))) {
+			ast_test_status_update(test, "%s differs from syn_output with %d samples\n",
+				evs_syn_output_name, i);
+			return AST_TEST_FAIL;
 		}
-		for (i = 0; i < num_bits; i = i + 1) {
-			/* unpack_bit increases the payload pointer by one after 8 bits
-			 * unpack_bit shifts the mask by one after each bit */
-			int bit_value = unpack_bit(&payload, &mask);
-			/* Returns the bit position for the current bit in
-			 * the current AMR-WB mode */
-			int position = sort_ptr[core_mode][i];
-			/* Writes (|=) at its new byte (/8) and bit (%8) position from
-			 * left to right (<<7-) */
-			apvt->fra[position / 8] |= (bit_value << (7 - (position % 8)));
-		}
-		/* Unpack auxiliary bits of Silence Insertion Description (SID) frame */
-		if (apvt->decoder->total_brate == SID_1k75)
-		{
-			Word16 sti = unpack_bit(&payload, &mask);
-			Word16 cmi = unpack_bit(&payload, &mask) << 3;
-			cmi |= unpack_bit(&payload, &mask) << 2;
-			cmi |= unpack_bit(&payload, &mask) << 1;
-			cmi |= unpack_bit(&payload, &mask) << 0;
-			if (sti == 0) { /* SID_FIRST; otherwise SID_UPDATE */
-				apvt->decoder->total_brate = 0;
+	}
+
+	start = ast_tvnow();
+	for (i = 0; i < rounds; i = i + 1) {
+		syn_output(synth, ARRAY_LEN(synth), expected);
+	}
+	library = ast_tvdiff_us(ast_tvnow(), start);
+	start = ast_tvnow();
+	for (i = 0; i < rounds; i = i + 1) {
+		evs_syn_output(synth, ARRAY_LEN(synth), actual);
+	}
+	kernel = ast_tvdiff_us(ast_tvnow(), start);
+
+	ast_test_status_update(test, "syn_output: %ld ns, %s: %ld ns per frame\n",
+		(long) (library * 1000 / rounds), evs_syn_output_name, (long) (kernel * 1000 / rounds));
+
+	return AST_TEST_PASS;
+}
+#endif
+
+/*
+ * Benchmark of the translators, see 'evs benchmark': builds a path slin to
+ * EVS and one back for each mode, and times each 20 ms frame through
+ * ast_translate. The input is synthetic speech, or a recording.
+ */
+#define BENCH_FRAMES 150 /* 3 s: a talk spurt of 2 s, then 1 s pause */
+
+struct evs_bench_case {
+	char name[24];
+	char fmtp[64];
+	unsigned int sample_rate;
+	int ch_aw;                          /* Channel-Aware mode (CA) */
+};
+
+struct evs_bench_result {
+	long long enc[3];                   /* ns: 50th, 90th, 99th percentile */
+	long long dec[3];
+	double enc_fps;                     /* frames per second, one core */
+	double dec_fps;
+	unsigned long bytes;                /* of the payloads */
+	size_t enc_state;                   /* bytes per translator path */
+	size_t dec_state;
+};
+
+static int evs_bench_cmp(const void *a, const void *b)
+{
+	const long long x = *(const long long *) a;
+	const long long y = *(const long long *) b;
+
+	return (x > y) - (x < y);
+}
+
+/* Sorts the times; 50th, 90th, and 99th percentile, and frames per second */
+static double evs_bench_percentiles(long long *ns, int count, long long *percentiles)
+{
+	long long total = 0;
+	int i;
+
+	if (0 == count) {
+		memset(percentiles, 0, 3 * sizeof(*percentiles));
+		return 0;
+	}
+	for (i = 0; i < count; i = i + 1) {
+		total = total + ns[i];
+	}
+	qsort(ns, count, sizeof(*ns), evs_bench_cmp);
+	percentiles[0] = ns[(count - 1) * 50 / 100];
+	percentiles[1] = ns[(count - 1) * 90 / 100];
+	percentiles[2] = ns[(count - 1) * 99 / 100];
+
+	return total ? 1e9 * count / total : 0;
+}
+
+/* Voiced speech: harmonics of a gliding pitch in syllables of 250 ms,
+ * talk spurts of 2 s, and pauses of 1 s with comfort noise for DTX */
+static void evs_bench_synthetic(short *pcm, int count, unsigned int sample_rate)
+{
+	unsigned int seed = 1;
+	double phase = 0;
+	int i;
+
+	for (i = 0; i < count; i = i + 1) {
+		const double t = (double) i / sample_rate;
+		const double pitch = 120 + 30 * sin(2 * M_PI * 0.7 * t);
+		const double envelope = sin(M_PI * fmod(t, 0.25) / 0.25);
+		double noise;
+		double value = 0;
+		int h;
+
+		phase = fmod(phase + 2 * M_PI * pitch / sample_rate, 2 * M_PI);
+		for (h = 1; h <= 20 && h * pitch < sample_rate / 2; h = h + 1) {
+			value = value + sin(h * phase) / h;
+		}
+		seed = seed * 1103515245 + 12345;
+		noise = ((seed >> 16) & 0x7fff) / 32768.0 - 0.5;
+		if (fmod(t, 3.0) < 2.0) {
+			pcm[i] = 6000 * envelope * value + 200 * noise;
+		} else {
+			pcm[i] = 30 * noise;
+		}
+	}
+}
+
+/* Resampled linearly and repeated to count samples */
+static void evs_bench_recording(short *pcm, int count, unsigned int sample_rate,
+	const short *recording, int length, unsigned int recording_rate)
+{
+	int i;
+
+	for (i = 0; i < count; i = i + 1) {
+		const double position = fmod((double) i * recording_rate / sample_rate, length - 1);
+		const int j = position;
+		const double fraction = position - j;
+
+		pcm[i] = (1 - fraction) * recording[j] + fraction * recording[j + 1];
+	}
+}
+
+/* Signed linear, 8 kHz; or 16, 32, 48 kHz by the extension .sln16, etc */
+static short *evs_bench_load(const char *filename, int *length, unsigned int *sample_rate)
+{
+	const char *extension = strrchr(filename, '.');
+	short *recording;
+	unsigned int khz;
+	FILE *file;
+	long size;
+
+	*sample_rate = 8000;
+	if (extension && 1 == sscanf(extension, ".sln%30u", &khz) &&
+		(16 == khz || 32 == khz || 48 == khz)) {
+		*sample_rate = khz * 1000;
+	}
+
+	file = fopen(filename, "rb");
+	if (NULL == file) {
+		return NULL;
+	}
+	fseek(file, 0, SEEK_END);
+	size = ftell(file);
+	fseek(file, 0, SEEK_SET);
+	recording = (0 < size) ? ast_malloc(size) : NULL;
+	if (recording) {
+		*length = fread(recording, sizeof(*recording), size / sizeof(*recording), file);
+	}
+	fclose(file);
+
+	/* At least two samples to interpolate between */
+	if (recording && *length < 2) {
+		ast_free(recording);
+		recording = NULL;
+	}
+
+	return recording;
+}
+
+static size_t evs_bench_state(struct ast_trans_pvt *path)
+{
+	size_t bytes = 0;
+
+	for (; path; path = path->next) {
+		bytes = bytes + sizeof(*path) + path->t->desc_size + path->t->buf_size;
+		if (path->t->newpvt == lintoevs_new) {
+			bytes = bytes + sizeof(struct evs_encoder);
+		} else if (path->t->newpvt == evstolin_new) {
+			bytes = bytes + sizeof(struct evs_decoder);
+		}
+	}
+
+	return bytes;
+}
+
+/* Benchmark and tests: no AMI event, see evs_stats_summary */
+static void evs_path_internal(struct ast_trans_pvt *path)
+{
+	for (; path; path = path->next) {
+		if (path->t->newpvt == lintoevs_new) {
+			((struct evs_encoder_pvt *) path->pvt)->stats.internal = 1;
+		} else if (path->t->newpvt == evstolin_new) {
+			((struct evs_decoder_pvt *) path->pvt)->stats.internal = 1;
+		}
+	}
+}
+
+/* Benchmark and tests: each frame of a list on its own; the outputs, chained */
+static struct ast_frame *evs_translate_each(struct ast_trans_pvt *path, struct ast_frame *list)
+{
+	struct ast_frame *result = NULL;
+	struct ast_frame *last = NULL;
+	struct ast_frame *current;
+	struct ast_frame *next;
+
+	for (current = list; current; current = next) {
+		struct ast_frame *out;
+
+		next = AST_LIST_NEXT(current, frame_list);
+		AST_LIST_NEXT(current, frame_list) = NULL;
+		out = ast_translate(path, current, 0);
+		AST_LIST_NEXT(current, frame_list) = next;
+		if (NULL == out) {
+			continue;
+		} else if (last) {
+			AST_LIST_NEXT(last, frame_list) = out;
+		} else {
+			result = out;
+		}
+		last = out;
+		while (AST_LIST_NEXT(last, frame_list)) {
+			last = AST_LIST_NEXT(last, frame_list);
+		}
+	}
+
+	return result;
+}
+
+static int evs_bench_run(const struct evs_bench_case *c, const short *pcm, int frames,
+	long long *enc_ns, long long *dec_ns, struct evs_bench_result *result)
+{
+	const int n_samples = FRAME_SAMPLES(c->sample_rate);
+	struct ast_format *slin = ast_format_cache_get_slin_by_rate(c->sample_rate);
+	struct ast_format *evs = ast_format_parse_sdp_fmtp(ast_format_evs, c->fmtp);
+	struct ast_trans_pvt *encoder = NULL;
+	struct ast_trans_pvt *decoder = NULL;
+	int decoded = 0;
+	int seqno = 0;
+	int i;
+
+	memset(result, 0, sizeof(*result));
+	if (NULL == evs) {
+		return -1;
+	}
+	if (c->ch_aw) {
+		struct evs_attr *attr = ast_format_get_attribute_data(evs);
+
+		/* Set by the SDP negotiation otherwise, see evs_getjoint */
+		attr->ch_aw_recv = c->ch_aw;
+	}
+
+	encoder = ast_translator_build_path(evs, slin);
+	decoder = ast_translator_build_path(slin, evs);
+	if (NULL == encoder || NULL == decoder) {
+		goto cleanup;
+	}
+	evs_path_internal(encoder);
+	evs_path_internal(decoder);
+	result->enc_state = evs_bench_state(encoder);
+	result->dec_state = evs_bench_state(decoder);
+
+	for (i = 0; i < frames; i = i + 1) {
+		struct ast_frame f = {
+			.frametype = AST_FRAME_VOICE,
+			.subclass.format = slin,
+			.datalen = n_samples * sizeof(*pcm),
+			.samples = n_samples,
+			.src = "evs benchmark",
+			.data.ptr = (void *) (pcm + i * n_samples),
+		};
+		struct ast_frame *payload;
+		struct ast_frame *current;
+		struct ast_frame *next;
+		long long start;
+
+		start = evs_now_ns();
+		payload = ast_translate(encoder, &f, 0);
+		enc_ns[i] = evs_now_ns() - start;
+
+		if (NULL == payload) {
+			continue; /* DTX, no payload */
+		}
+		for (current = payload; current; current = AST_LIST_NEXT(current, frame_list)) {
+			result->bytes = result->bytes + current->datalen;
+			current->seqno = seqno; /* without gaps: no concealment */
+			seqno = seqno + 1;
+		}
+
+		/* Each payload on its own, with the time of each */
+		for (current = payload; current && decoded < frames; current = next) {
+			struct ast_frame *pcm_out;
+
+			next = AST_LIST_NEXT(current, frame_list);
+			AST_LIST_NEXT(current, frame_list) = NULL;
+			start = evs_now_ns();
+			pcm_out = ast_translate(decoder, current, 0);
+			dec_ns[decoded] = evs_now_ns() - start;
+			decoded = decoded + 1;
+			AST_LIST_NEXT(current, frame_list) = next;
+
+			if (pcm_out) {
+				ast_frfree(pcm_out);
 			}
 		}
-		payload = apvt->fra;
-		/* read_indices_from_djb could be avoided for AMR-WB, which would
-		 * avoid one round of bit-shuffling. However, many flags of the
-		 * decoder state are set by this function. Please, report this as
-		 * issue, if you are affected by this additional bit-shuffling. */
+		ast_frfree(payload);
 	}
-	read_indices_from_djb(apvt->decoder, payload, num_bits, 0, 0);
 
-	if (apvt->decoder->Opt_AMR_WB) {
-		amr_wb_dec(apvt->decoder, apvt->con);
+	result->enc_fps = evs_bench_percentiles(enc_ns, frames, result->enc);
+	result->dec_fps = evs_bench_percentiles(dec_ns, decoded, result->dec);
+
+cleanup:
+	if (decoder) {
+		ast_translator_free_path(decoder);
+	}
+	if (encoder) {
+		ast_translator_free_path(encoder);
+	}
+	ao2_cleanup(evs);
+
+	return (encoder && decoder) ? 0 : -1;
+}
+
+/* Each bit-rate in each bandwidth it is available, with and without DTX;
+ * Channel-Aware mode (CA) at 13.2; each mode of AMR-WB IO */
+static int evs_bench_cases(struct evs_bench_case *cases, int max)
+{
+	static const char *const rates[] = { "5.9", "7.2", "8", "9.6", "13.2", "16.4",
+		"24.4", "32", "48", "64", "96", "128" };
+	/* Index of the lowest and the highest bit-rate in each bandwidth */
+	static const struct { const char *name; unsigned int sample_rate; int low, high; } bandwidths[] = {
+		{ "nb",   8000, 0,  6 },
+		{ "wb",  16000, 0, 11 },
+		{ "swb", 32000, 3, 11 },
+		{ "fb",  48000, 5, 11 },
+	};
+	static const char *const amr_wb[] = { "6.6", "8.85", "12.65", "14.25", "15.85",
+		"18.25", "19.85", "23.05", "23.85" };
+	int count = 0;
+	int b;
+	int r;
+	int dtx;
+
+	for (b = 0; b < ARRAY_LEN(bandwidths); b = b + 1) {
+		for (r = bandwidths[b].low; r <= bandwidths[b].high; r = r + 1) {
+			for (dtx = 1; 0 <= dtx; dtx = dtx - 1) {
+				struct evs_bench_case *c = &cases[count];
+
+				if (count == max) {
+					return count;
+				}
+				/* SC-VBR (5.9) requires DTX */
+				if (0 == r && 0 == dtx) {
+					continue;
+				}
+				snprintf(c->name, sizeof(c->name), "EVS %s %s%s", rates[r],
+					bandwidths[b].name, dtx ? " DTX" : "");
+				snprintf(c->fmtp, sizeof(c->fmtp), "br=%s; bw=%s; dtx=%d",
+					rates[r], bandwidths[b].name, dtx);
+				c->sample_rate = bandwidths[b].sample_rate;
+				c->ch_aw = 0;
+				count = count + 1;
+			}
+		}
+	}
+
+	for (b = 1; b <= 2 && count < max; b = b + 1) {
+		struct evs_bench_case *c = &cases[count];
+
+		snprintf(c->name, sizeof(c->name), "EVS 13.2 %s CA", bandwidths[b].name);
+		snprintf(c->fmtp, sizeof(c->fmtp), "br=13.2; bw=%s; dtx=0; ch-aw-recv=3",
+			bandwidths[b].name);
+		c->sample_rate = bandwidths[b].sample_rate;
+		c->ch_aw = 3;
+		count = count + 1;
+	}
+
+	for (r = 0; r < ARRAY_LEN(amr_wb) && count < max; r = r + 1) {
+		struct evs_bench_case *c = &cases[count];
+
+		snprintf(c->name, sizeof(c->name), "AMR-WB IO %s", amr_wb[r]);
+		snprintf(c->fmtp, sizeof(c->fmtp), "evs-mode-switch=1; mode-set=%d; dtx=0", r);
+		c->sample_rate = 16000;
+		c->ch_aw = 0;
+		count = count + 1;
+	}
+
+	return count;
+}
+
+static char *handle_cli_evs_benchmark(struct ast_cli_entry *e, int cmd, struct ast_cli_args *a)
+{
+	struct evs_bench_case cases[96];
+	long long *enc_ns = NULL;
+	long long *dec_ns = NULL;
+	short *pcm = NULL;
+	short *recording = NULL;
+	unsigned int recording_rate = 0;
+	unsigned int sample_rate = 0;
+	int length = 0;
+	int frames = BENCH_FRAMES;
+	int count;
+	int i;
+
+	switch (cmd) {
+	case CLI_INIT:
+		e->command = "evs benchmark";
+		e->usage =
+			"Usage: evs benchmark [<frames> [<file>]]\n"
+			"       Encodes and decodes each mode of 3GPP EVS, and shows the time per\n"
+			"       20 ms frame (50th, 90th, and 99th percentile), the frames per second\n"
+			"       on one core, and the memory of each translator path. The input is\n"
+			"       synthetic speech (default: 150 frames), or a recording in signed\n"
+			"       linear (.sln, .sln16, .sln32, .sln48). Takes a while.\n";
+		return NULL;
+	case CLI_GENERATE:
+		return NULL;
+	}
+
+	if (a->argc < 2 || 4 < a->argc) {
+		return CLI_SHOWUSAGE;
+	}
+	if (3 <= a->argc && (1 != sscanf(a->argv[2], "%30d", &frames) ||
+		frames < 1 || 50 * 3600 < frames)) {
+		return CLI_SHOWUSAGE;
+	}
+	if (4 == a->argc) {
+		recording = evs_bench_load(a->argv[3], &length, &recording_rate);
+		if (NULL == recording) {
+			ast_cli(a->fd, "Unable to read '%s'\n", a->argv[3]);
+			return CLI_FAILURE;
+		}
+	}
+
+	/* 48 kHz is the largest */
+	pcm = ast_malloc(frames * FRAME_SAMPLES(48000) * sizeof(*pcm));
+	enc_ns = ast_malloc(frames * sizeof(*enc_ns));
+	dec_ns = ast_malloc(frames * sizeof(*dec_ns));
+	if (NULL == pcm || NULL == enc_ns || NULL == dec_ns) {
+		goto cleanup;
+	}
+
+	ast_cli(a->fd, "%d frames of %s, %s, output %s\n", frames, recording ? a->argv[3] : "synthetic speech",
+		evs_workers_count ? "asynchronous" : "synchronous", evs_syn_output_name);
+	ast_cli(a->fd, "%-18s | %8s %8s %8s %8s | %8s %8s %8s %8s | %6s %7s %7s\n", "Mode",
+		"Encode", "p90", "p99", "fps", "Decode", "p90", "p99", "fps", "kbps", "Enc. KB", "Dec. KB");
+
+	count = evs_bench_cases(cases, ARRAY_LEN(cases));
+	for (i = 0; i < count; i = i + 1) {
+		struct evs_bench_result result;
+
+		if (sample_rate != cases[i].sample_rate) {
+			const int samples = frames * FRAME_SAMPLES(cases[i].sample_rate);
+
+			sample_rate = cases[i].sample_rate;
+			if (recording) {
+				evs_bench_recording(pcm, samples, sample_rate, recording, length, recording_rate);
+			} else {
+				evs_bench_synthetic(pcm, samples, sample_rate);
+			}
+		}
+
+		if (evs_bench_run(&cases[i], pcm, frames, enc_ns, dec_ns, &result)) {
+			ast_cli(a->fd, "%-18s | no translator path\n", cases[i].name);
+			continue;
+		}
+		ast_cli(a->fd, "%-18s | %8lld %8lld %8lld %8.0f | %8lld %8lld %8lld %8.0f | %6.1f %7.1f %7.1f\n",
+			cases[i].name,
+			result.enc[0], result.enc[1], result.enc[2], result.enc_fps,
+			result.dec[0], result.dec[1], result.dec[2], result.dec_fps,
+			result.bytes * 8.0 / (frames * 20), /* bits per ms */
+			result.enc_state / 1024.0, result.dec_state / 1024.0);
+	}
+	ast_cli(a->fd, "Times in ns per frame; fps: frames per second on one core\n");
+
+cleanup:
+	ast_free(dec_ns);
+	ast_free(enc_ns);
+	ast_free(pcm);
+	ast_free(recording);
+
+	return CLI_SUCCESS;
+}
+
+#ifdef TEST_FRAMEWORK
+/*
+ * Scaling of concurrent translator paths: each thread builds its own
+ * paths slin16 to EVS and back, and pushes 20 ms frames through them, as
+ * fast as possible or paced in real time. Shows the throughput, the time
+ * per frame (encode and decode) up to the 99.9th percentile, and how much
+ * the resident memory grew.
+ */
+#define SCALING_THREADS 8               /* at most; not more than cores */
+#define SCALING_PATHS   4               /* per thread */
+/* Generous limits, to catch regressions, not to rate the machine: */
+#define SCALING_MIN_FPS      50         /* max. rate, per thread: one call */
+#define SCALING_MAX_P99_NS   20000000   /* a frame within its 20 ms */
+#define SCALING_MAX_LATE     10         /* real time: percent of the steps */
+#define SCALING_MAX_RSS_KB   8192       /* per path, encoder and decoder */
+
+struct evs_scaling_thread {
+	pthread_t thread;
+	int realtime;                       /* paced every 20 ms */
+	int frames;
+	const short *pcm;                   /* BENCH_FRAMES of 16 kHz */
+	long long *ns;                      /* SCALING_PATHS * frames */
+	int count;                          /* in ns */
+	int decoded;                        /* frames back in slin */
+	int failures;                       /* paths not built */
+	int late;                           /* real time: behind the clock */
+};
+
+/* Resident set size (RSS) */
+static long evs_rss_kb(void)
+{
+	FILE *statm = fopen("/proc/self/statm", "r");
+	long pages = 0;
+
+	if (statm) {
+		if (1 != fscanf(statm, "%*d %ld", &pages)) {
+			pages = 0;
+		}
+		fclose(statm);
+	}
+
+	return pages * (sysconf(_SC_PAGESIZE) / 1024);
+}
+
+static void *evs_scaling_thread(void *data)
+{
+	struct evs_scaling_thread *st = data;
+	const int n_samples = FRAME_SAMPLES(16000);
+	/* Without DTX, each frame gets decoded */
+	struct ast_format *evs = ast_format_parse_sdp_fmtp(ast_format_evs, "br=13.2; bw=wb; dtx=0");
+	struct ast_trans_pvt *encoders[SCALING_PATHS] = { NULL, };
+	struct ast_trans_pvt *decoders[SCALING_PATHS] = { NULL, };
+	long long next = evs_now_ns();
+	int i;
+	int j;
+
+	for (j = 0; j < SCALING_PATHS && evs; j = j + 1) {
+		encoders[j] = ast_translator_build_path(evs, ast_format_slin16);
+		decoders[j] = ast_translator_build_path(ast_format_slin16, evs);
+		if (NULL == encoders[j] || NULL == decoders[j]) {
+			st->failures = st->failures + 1;
+		}
+		evs_path_internal(encoders[j]);
+		evs_path_internal(decoders[j]);
+	}
+	if (NULL == evs) {
+		st->failures = st->failures + 1;
+	}
+
+	for (i = 0; i < st->frames && 0 == st->failures; i = i + 1) {
+		for (j = 0; j < SCALING_PATHS; j = j + 1) {
+			/* Different input for each path, see shared_encoder */
+			struct ast_frame f = {
+				.frametype = AST_FRAME_VOICE,
+				.subclass.format = ast_format_slin16,
+				.datalen = n_samples * sizeof(*st->pcm),
+				.samples = n_samples,
+				.seqno = i,
+				.src = "evs scaling",
+				.data.ptr = (void *) (st->pcm + ((i + 7 * j) % BENCH_FRAMES) * n_samples),
+			};
+			struct ast_frame *payload;
+			struct ast_frame *out = NULL;
+			long long start;
+
+			start = evs_now_ns();
+			payload = ast_translate(encoders[j], &f, 0);
+			if (payload) {
+				out = evs_translate_each(decoders[j], payload);
+			}
+			st->ns[st->count] = evs_now_ns() - start;
+			st->count = st->count + 1;
+
+			/* None with async_workers or a ptime above 20 ms sometimes */
+			if (out) {
+				st->decoded = st->decoded + 1;
+				ast_frfree(out);
+			}
+			if (payload) {
+				ast_frfree(payload);
+			}
+		}
+
+		if (st->realtime) {
+			const long long now = evs_now_ns();
+
+			next = next + 20000000;
+			if (next < now) {
+				st->late = st->late + 1;
+			} else {
+				usleep((next - now) / 1000);
+			}
+		}
+	}
+
+	for (j = 0; j < SCALING_PATHS; j = j + 1) {
+		if (decoders[j]) {
+			ast_translator_free_path(decoders[j]);
+		}
+		if (encoders[j]) {
+			ast_translator_free_path(encoders[j]);
+		}
+	}
+	ao2_cleanup(evs);
+
+	return NULL;
+}
+
+static enum ast_test_result_state evs_scaling_run(struct ast_test *test, int realtime)
+{
+	const long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+	const int threads = MAX(1, MIN(SCALING_THREADS, cpus));
+	const int frames = realtime ? 100 : 250;
+	struct evs_scaling_thread st[SCALING_THREADS];
+	enum ast_test_result_state res = AST_TEST_PASS;
+	long long percentiles[3];
+	long long *ns;
+	short *pcm;
+	long long start;
+	long long elapsed;
+	long rss;
+	int count = 0;
+	int decoded = 0;
+	int late = 0;
+	int t;
+
+	pcm = ast_malloc(BENCH_FRAMES * FRAME_SAMPLES(16000) * sizeof(*pcm));
+	ns = ast_calloc(threads * SCALING_PATHS * frames, sizeof(*ns));
+	if (NULL == pcm || NULL == ns) {
+		ast_free(ns);
+		ast_free(pcm);
+		return AST_TEST_FAIL;
+	}
+	evs_bench_synthetic(pcm, BENCH_FRAMES * FRAME_SAMPLES(16000), 16000);
+
+	memset(st, 0, sizeof(st));
+	rss = evs_rss_kb();
+	start = evs_now_ns();
+	for (t = 0; t < threads; t = t + 1) {
+		st[t].realtime = realtime;
+		st[t].frames = frames;
+		st[t].pcm = pcm;
+		st[t].ns = ns + t * SCALING_PATHS * frames;
+		if (ast_pthread_create(&st[t].thread, NULL, evs_scaling_thread, &st[t])) {
+			st[t].thread = AST_PTHREADT_NULL;
+			st[t].failures = 1;
+		}
+	}
+	for (t = 0; t < threads; t = t + 1) {
+		if (st[t].thread != AST_PTHREADT_NULL) {
+			pthread_join(st[t].thread, NULL);
+		}
+	}
+	elapsed = evs_now_ns() - start;
+	rss = evs_rss_kb() - rss;
+
+	/* All times in one row for the percentiles */
+	for (t = 0; t < threads; t = t + 1) {
+		memmove(ns + count, st[t].ns, st[t].count * sizeof(*ns));
+		count = count + st[t].count;
+		decoded = decoded + st[t].decoded;
+		late = late + st[t].late;
+		if (st[t].failures) {
+			ast_test_status_update(test, "Thread %d: %d translator paths failed\n",
+				t + 1, st[t].failures);
+			res = AST_TEST_FAIL;
+		}
+	}
+	if (0 == decoded) {
+		ast_test_status_update(test, "No frame was decoded\n");
+		res = AST_TEST_FAIL;
+	}
+	/* Sorts ns; the 99.9th percentile from there */
+	evs_bench_percentiles(ns, count, percentiles);
+
+	ast_test_status_update(test, "%d threads with %d paths each, %s: %.0f frames/s\n",
+		threads, SCALING_PATHS, realtime ? "real time" : "max. rate",
+		elapsed ? 1e9 * count / elapsed : 0);
+	ast_test_status_update(test, "Encode and decode per frame: 50th %lld ns, 99th %lld ns, "
+		"99.9th %lld ns\n", percentiles[0], percentiles[2], count ? ns[(count - 1) * 999 / 1000] : 0);
+	if (realtime) {
+		ast_test_status_update(test, "Behind the clock: %d of %d steps\n", late, threads * frames);
+	}
+	ast_test_status_update(test, "Resident memory grew by %ld KB (pool: %u idle states max.)\n",
+		rss, evs_pool_max);
+
+	if (!realtime && elapsed && 1e9 * count / elapsed < SCALING_MIN_FPS * threads) {
+		ast_test_status_update(test, "Below %d frames/s per thread\n", SCALING_MIN_FPS);
+		res = AST_TEST_FAIL;
+	}
+	if (SCALING_MAX_P99_NS < percentiles[2]) {
+		ast_test_status_update(test, "99th percentile above %d ms\n", SCALING_MAX_P99_NS / 1000000);
+		res = AST_TEST_FAIL;
+	}
+	if (realtime && SCALING_MAX_LATE * threads * frames < 100 * late) {
+		ast_test_status_update(test, "Behind the clock in more than %d%% of the steps\n",
+			SCALING_MAX_LATE);
+		res = AST_TEST_FAIL;
+	}
+	if ((long) SCALING_MAX_RSS_KB * threads * SCALING_PATHS < rss) {
+		ast_test_status_update(test, "Resident memory grew by more than %d KB per path\n",
+			SCALING_MAX_RSS_KB);
+		res = AST_TEST_FAIL;
+	}
+
+	ast_free(ns);
+	ast_free(pcm);
+
+	return res;
+}
+
+AST_TEST_DEFINE(evs_scaling_test)
+{
+	switch (cmd) {
+	case TEST_INIT:
+		info->name = "scaling";
+		info->category = "/codecs/evs/";
+		info->summary = "Concurrent translator paths at max. rate";
+		info->description =
+			"Builds EVS paths in several threads and pushes 20 ms frames "
+			"through them as fast as possible; shows the throughput, the "
+			"time per frame up to the 99.9th percentile, and the growth "
+			"of the resident memory. Fails below 50 frames/s per thread, "
+			"with a 99th percentile above 20 ms, or with more than 8 MB "
+			"of memory per path.";
+		return AST_TEST_NOT_RUN;
+	case TEST_EXECUTE:
+		break;
+	}
+
+	return evs_scaling_run(test, 0);
+}
+
+AST_TEST_DEFINE(evs_scaling_realtime_test)
+{
+	switch (cmd) {
+	case TEST_INIT:
+		info->name = "scaling_realtime";
+		info->category = "/codecs/evs/";
+		info->summary = "Concurrent translator paths in real time";
+		info->description =
+			"Like scaling, but each thread sends a frame every 20 ms, as "
+			"calls do; shows as well, how often a thread fell behind. "
+			"Fails when that happens in more than 10% of the steps.";
+		return AST_TEST_NOT_RUN;
+	case TEST_EXECUTE:
+		break;
+	}
+
+	return evs_scaling_run(test, 1);
+}
+
+/*
+ * Round trip of AMR-WB IO through both translators: amr_wb_enc, the
+ * payload, evs_amr_wb_unsort, and amr_wb_dec. Bits in a wrong order on
+ * the wire give noise; the decoded signal does not follow the input then.
+ */
+#define ROUNDTRIP_FRAMES 100            /* 2 s of speech, see evs_bench_synthetic */
+#define ROUNDTRIP_LAG    1600           /* 100 ms: delay of the codec and async_workers */
+
+/* Normalized cross-correlation at the best lag of the output */
+static double evs_roundtrip_correlation(const short *input, const short *output, int count)
+{
+	double best = 0;
+	int lag;
+	int i;
+
+	for (lag = 0; lag < ROUNDTRIP_LAG; lag = lag + 1) {
+		double xy = 0;
+		double xx = 0;
+		double yy = 0;
+
+		for (i = 0; i + lag < count; i = i + 1) {
+			xy = xy + (double) input[i] * output[i + lag];
+			xx = xx + (double) input[i] * input[i];
+			yy = yy + (double) output[i + lag] * output[i + lag];
+		}
+		if (0 < xx && 0 < yy) {
+			best = MAX(best, xy / sqrt(xx * yy));
+		}
+	}
+
+	return best;
+}
+
+static enum ast_test_result_state evs_roundtrip_run(struct ast_test *test, const char *fmtp)
+{
+	const int n_samples = FRAME_SAMPLES(16000);
+	const int count = ROUNDTRIP_FRAMES * n_samples;
+	struct ast_format *evs = ast_format_parse_sdp_fmtp(ast_format_evs, fmtp);
+	struct ast_trans_pvt *encoder = NULL;
+	struct ast_trans_pvt *decoder = NULL;
+	enum ast_test_result_state res = AST_TEST_FAIL;
+	short *input = ast_malloc(count * sizeof(*input));
+	short *output = ast_calloc(count, sizeof(*output));
+	int decoded = 0;
+	int i;
+
+	if (evs) {
+		encoder = ast_translator_build_path(evs, ast_format_slin16);
+		decoder = ast_translator_build_path(ast_format_slin16, evs);
+		evs_path_internal(encoder);
+		evs_path_internal(decoder);
+	}
+
+	if (input && output && encoder && decoder) {
+		double correlation;
+
+		evs_bench_synthetic(input, count, 16000);
+		for (i = 0; i < ROUNDTRIP_FRAMES; i = i + 1) {
+			struct ast_frame f = {
+				.frametype = AST_FRAME_VOICE,
+				.subclass.format = ast_format_slin16,
+				.datalen = n_samples * sizeof(*input),
+				.samples = n_samples,
+				.seqno = i,
+				.src = "evs roundtrip",
+				.data.ptr = input + i * n_samples,
+			};
+			struct ast_frame *payload = ast_translate(encoder, &f, 0);
+			struct ast_frame *out = payload ? evs_translate_each(decoder, payload) : NULL;
+			struct ast_frame *current;
+
+			for (current = out; current; current = AST_LIST_NEXT(current, frame_list)) {
+				const int samples = MIN(current->samples, count - decoded);
+
+				memcpy(output + decoded, current->data.ptr, samples * sizeof(*output));
+				decoded = decoded + samples;
+			}
+			if (out) {
+				ast_frfree(out);
+			}
+			if (payload) {
+				ast_frfree(payload);
+			}
+		}
+
+		correlation = evs_roundtrip_correlation(input, output, decoded);
+		ast_test_status_update(test, "%s: %d samples decoded, correlation %.2f\n",
+			fmtp, decoded, correlation);
+		if (0.5 <= correlation) {
+			res = AST_TEST_PASS;
+		}
 	} else {
-		evs_dec(apvt->decoder, apvt->con, bad_frame);
+		ast_test_status_update(test, "No translator path for '%s'\n", fmtp);
 	}
-	syn_output(apvt->con, n_samples, pvt->outbuf.i16 + pvt->samples);
 
-	if (apvt->decoder->ini_frame < MAX_FRAME_COUNTER) {
-		apvt->decoder->ini_frame = apvt->decoder->ini_frame + 1;
+	if (decoder) {
+		ast_translator_free_path(decoder);
 	}
+	if (encoder) {
+		ast_translator_free_path(encoder);
+	}
+	ao2_cleanup(evs);
+	ast_free(output);
+	ast_free(input);
 
-	pvt->samples += n_samples;
-	pvt->datalen += n_samples * 2;
+	return res;
+}
 
-	return 0;
+AST_TEST_DEFINE(evs_amr_wb_io_test)
+{
+	enum ast_test_result_state res;
+
+	switch (cmd) {
+	case TEST_INIT:
+		info->name = "amr_wb_io";
+		info->category = "/codecs/evs/";
+		info->summary = "Round trip of AMR-WB IO";
+		info->description =
+			"Encodes synthetic speech as AMR-WB IO 12.65, in Header-Full "
+			"and in Compact format, and decodes it again; the output "
+			"must follow the input.";
+		return AST_TEST_NOT_RUN;
+	case TEST_EXECUTE:
+		break;
+	}
+
+	res = evs_roundtrip_run(test, "evs-mode-switch=1; mode-set=2; dtx=0; hf-only=1");
+	if (AST_TEST_PASS == res) {
+		res = evs_roundtrip_run(test, "evs-mode-switch=1; mode-set=2; dtx=0");
+	}
+
+	return res;
 }
 
-static void lintoevs_destroy(struct ast_trans_pvt *pvt)
+/*
+ * Two calls with different speech, each followed by the same silence:
+ * with 40 ms per payload, a call which joined the group of the other on
+ * the silence would send the speech of that other call.
+ */
+#define SHARED_STEPS 50
+
+AST_TEST_DEFINE(evs_shared_encoder_test)
 {
-	struct evs_coder_pvt *apvt = pvt->pvt;
+	const int n_samples = FRAME_SAMPLES(16000);
+	const int shared_encoder = evs_shared_encoder;
+	struct ast_format *evs_fmtp = ast_format_parse_sdp_fmtp(ast_format_evs, "dtx=0");
+	struct ast_format *evs = evs_fmtp ? ast_format_attribute_set(evs_fmtp, "ptime", "40") : NULL;
+	struct ast_trans_pvt *path[2] = { NULL, NULL };
+	enum ast_test_result_state res = AST_TEST_FAIL;
+	short *speech = ast_malloc((SHARED_STEPS + 37) * n_samples * sizeof(*speech));
+	short *silence = ast_calloc(n_samples, sizeof(*silence));
+	int payloads = 0;
+	int leaked = 0;
+	int i;
+	int k;
 
-	if (NULL == apvt || NULL == apvt->encoder) {
-		return;
+	switch (cmd) {
+	case TEST_INIT:
+		info->name = "shared_encoder";
+		info->category = "/codecs/evs/";
+		info->summary = "Shared encoders keep calls apart";
+		info->description =
+			"Encodes different speech in two calls, each 20 ms followed "
+			"by the same 20 ms of silence, with 40 ms per payload and "
+			"shared encoders; no payload may be sent in both calls.";
+		return AST_TEST_NOT_RUN;
+	case TEST_EXECUTE:
+		break;
+	}
+
+	/* For new translator paths only, see reload */
+	evs_shared_encoder = 1;
+	if (evs) {
+		path[0] = ast_translator_build_path(evs, ast_format_slin16);
+		path[1] = ast_translator_build_path(evs, ast_format_slin16);
+		evs_path_internal(path[0]);
+		evs_path_internal(path[1]);
 	}
+	evs_shared_encoder = shared_encoder;
 
-	destroy_encoder(apvt->encoder);
-	ast_free(apvt->encoder);
+	if (speech && silence && path[0] && path[1]) {
+		evs_bench_synthetic(speech, (SHARED_STEPS + 37) * n_samples, 16000);
+		for (i = 0; i < SHARED_STEPS; i = i + 1) {
+			struct ast_frame *payload[2];
 
-	ast_debug(3, "Destroyed encoder (3GPP EVS)\n");
+			for (k = 0; k < 2; k = k + 1) {
+				struct ast_frame f = {
+					.frametype = AST_FRAME_VOICE,
+					.subclass.format = ast_format_slin16,
+					.datalen = n_samples * sizeof(*speech),
+					.samples = n_samples,
+					.seqno = i,
+					.src = "evs shared",
+					.data.ptr = (i % 2) ? silence : speech + (i + 37 * k) * n_samples,
+				};
+
+				payload[k] = ast_translate(path[k], &f, 0);
+			}
+
+			if (payload[0] && payload[1]) {
+				payloads = payloads + 1;
+				if (payload[0]->datalen == payload[1]->datalen &&
+					!memcmp(payload[0]->data.ptr, payload[1]->data.ptr, payload[0]->datalen)) {
+					leaked = leaked + 1;
+				}
+			}
+			for (k = 0; k < 2; k = k + 1) {
+				if (payload[k]) {
+					ast_frfree(payload[k]);
+				}
+			}
+		}
+
+		ast_test_status_update(test, "%d payloads, %d sent in both calls\n", payloads, leaked);
+		if (payloads && 0 == leaked) {
+			res = AST_TEST_PASS;
+		}
+	} else {
+		ast_test_status_update(test, "No translator path for EVS with 40 ms\n");
+	}
+
+	for (k = 0; k < 2; k = k + 1) {
+		if (path[k]) {
+			ast_translator_free_path(path[k]);
+		}
+	}
+	ao2_cleanup(evs);
+	ao2_cleanup(evs_fmtp);
+	ast_free(silence);
+	ast_free(speech);
+
+	return res;
 }
+#endif
 
-static void evstolin_destroy(struct ast_trans_pvt *pvt)
+/* Snapshot of the counters of the module, each read atomically */
+static void evs_stats_load(const struct evs_stats *module, struct evs_stats *stats)
 {
-	struct evs_coder_pvt *apvt = pvt->pvt;
+	int i;
 
-	if (NULL == apvt || NULL == apvt->decoder) {
-		return;
+	stats->frames = __atomic_load_n(&module->frames, __ATOMIC_RELAXED);
+	for (i = 0; i < STATS_MODES; i = i + 1) {
+		stats->modes[i] = __atomic_load_n(&module->modes[i], __ATOMIC_RELAXED);
 	}
+	stats->cmr = __atomic_load_n(&module->cmr, __ATOMIC_RELAXED);
+	stats->concealed = __atomic_load_n(&module->concealed, __ATOMIC_RELAXED);
+	stats->corrupt = __atomic_load_n(&module->corrupt, __ATOMIC_RELAXED);
+	for (i = 0; i < STATS_TIMES; i = i + 1) {
+		stats->times[i] = __atomic_load_n(&module->times[i], __ATOMIC_RELAXED);
+	}
+	stats->ns = __atomic_load_n(&module->ns, __ATOMIC_RELAXED);
+	stats->state = __atomic_load_n(&module->state, __ATOMIC_RELAXED);
+}
 
-	destroy_decoder(apvt->decoder);
-	ast_free(apvt->decoder);
+static char *handle_cli_evs_show_stats(struct ast_cli_entry *e, int cmd, struct ast_cli_args *a)
+{
+	struct evs_stats encoder;
+	struct evs_stats decoder;
+	int i;
 
-	ast_debug(3, "Destroyed decoder (3GPP EVS)\n");
+	switch (cmd) {
+	case CLI_INIT:
+		e->command = "evs show stats";
+		e->usage =
+			"Usage: evs show stats\n"
+			"       Displays statistics of the 3GPP EVS transcoding module.\n";
+		return NULL;
+	case CLI_GENERATE:
+		return NULL;
+	}
+
+	if (a->argc != 3) {
+		return CLI_SHOWUSAGE;
+	}
+
+	ast_mutex_lock(&evs_pool_lock);
+	ast_cli(a->fd, "Pool of coder states (max. %u idle per direction)\n", evs_pool_max);
+	ast_cli(a->fd, "  %-10s %8s %12s %12s\n", "Direction", "Idle", "Hits", "Misses");
+	ast_cli(a->fd, "  %-10s %8u %12u %12u\n", "Encoder",
+		evs_encoder_pool_count, evs_encoder_pool_hits, evs_encoder_pool_misses);
+	ast_cli(a->fd, "  %-10s %8u %12u %12u\n", "Decoder",
+		evs_decoder_pool_count, evs_decoder_pool_hits, evs_decoder_pool_misses);
+	ast_mutex_unlock(&evs_pool_lock);
+
+	ast_mutex_lock(&evs_jbm_lock);
+	ast_cli(a->fd, "Jitter buffer (%s)\n", evs_jbm ? "enabled" : "disabled");
+	ast_cli(a->fd, "  %-10s %8u\n", "Sessions", evs_jbm_sessions);
+	ast_cli(a->fd, "  %-10s %8u ms\n", "Avg. delay",
+		evs_jbm_sessions ? evs_jbm_delay_total / evs_jbm_sessions : 0);
+	ast_mutex_unlock(&evs_jbm_lock);
+
+	ast_cli(a->fd, "Output sample rate\n");
+	ast_cli(a->fd, "  %-10s %8u\n", "Decoders", __atomic_load_n(&evs_decoders_done, __ATOMIC_RELAXED));
+	ast_cli(a->fd, "  %-10s %8u (above the bandwidth of the content or bw-recv)\n", "Oversampled",
+		__atomic_load_n(&evs_decoders_oversampled, __ATOMIC_RELAXED));
+
+	evs_stats_load(&evs_encoder_stats, &encoder);
+	evs_stats_load(&evs_decoder_stats, &decoder);
+	ast_cli(a->fd, "Frames\n");
+	ast_cli(a->fd, "  %-10s %12s %12s\n", "", "Encoder", "Decoder");
+	ast_cli(a->fd, "  %-10s %12u %12u\n", "Total", encoder.frames, decoder.frames);
+	ast_cli(a->fd, "  %-10s %12u %12u (SID and NO_DATA)\n", "DTX",
+		evs_stats_dtx(&encoder), evs_stats_dtx(&decoder));
+	ast_cli(a->fd, "  %-10s %12u %12u\n", "CMR", encoder.cmr, decoder.cmr);
+	ast_cli(a->fd, "  %-10s %12s %12u\n", "Concealed", "-", decoder.concealed);
+	ast_cli(a->fd, "  %-10s %12u %12u (payloads dropped)\n", "Corrupt",
+		encoder.corrupt, decoder.corrupt);
+	ast_cli(a->fd, "  %-10s %12llu %12llu ns\n", "Avg. time",
+		encoder.frames ? encoder.ns / encoder.frames : 0,
+		decoder.frames ? decoder.ns / decoder.frames : 0);
+	ast_cli(a->fd, "Modes (ToC)\n");
+	for (i = 0; i < STATS_MODES; i = i + 1) {
+		if (encoder.modes[i] || decoder.modes[i]) {
+			ast_cli(a->fd, "  %-10s %12u %12u\n", stats_mode_names[i],
+				encoder.modes[i], decoder.modes[i]);
+		}
+	}
+	ast_cli(a->fd, "Time per frame\n");
+	for (i = 0; i < STATS_TIMES; i = i + 1) {
+		ast_cli(a->fd, "  %-10s %12u %12u\n", stats_time_names[i],
+			encoder.times[i], decoder.times[i]);
+	}
+	ast_cli(a->fd, "State\n");
+	ast_cli(a->fd, "  %-10s %12u %12u\n", "Active",
+		__atomic_load_n(&evs_encoders_active, __ATOMIC_RELAXED),
+		__atomic_load_n(&evs_decoders_active, __ATOMIC_RELAXED));
+	ast_cli(a->fd, "  %-10s %12lu %12lu KB\n", "Memory",
+		encoder.state / 1024, decoder.state / 1024);
+
+	ast_mutex_lock(&evs_shared_lock);
+	ast_cli(a->fd, "Shared encoders (%s)\n", evs_shared_encoder ? "enabled" : "disabled");
+	ast_cli(a->fd, "  %-10s %8u\n", "Groups", evs_shared_count);
+	ast_cli(a->fd, "  %-10s %8u\n", "Calls", evs_shared_calls);
+	ast_mutex_unlock(&evs_shared_lock);
+	ast_cli(a->fd, "  %-10s %8u\n", "Encoded", __atomic_load_n(&evs_shared_encoded, __ATOMIC_RELAXED));
+	ast_cli(a->fd, "  %-10s %8u (frames from another call)\n", "Reused",
+		__atomic_load_n(&evs_shared_reused, __ATOMIC_RELAXED));
+
+	if (evs_workers_count) {
+		unsigned int i;
+
+		ast_cli(a->fd, "Asynchronous workers (%u)\n", evs_workers_count);
+		ast_cli(a->fd, "  %-10s %4s %8s %12s %6s %6s %12s\n", "Worker", "CPU", "Calls", "Jobs",
+			"Queue", "Max.", "Waits");
+		for (i = 0; i < evs_workers_count; i = i + 1) {
+			struct evs_async_worker *worker = &evs_workers[i];
+
+			ast_mutex_lock(&worker->lock);
+			ast_cli(a->fd, "  %-10u %4d %8u %12u %6u %6u %12u\n", i + 1,
+				__atomic_load_n(&worker->cpu, __ATOMIC_RELAXED),
+				worker->calls, worker->jobs, worker->depth, worker->depth_max, worker->waits);
+			ast_mutex_unlock(&worker->lock);
+		}
+	}
+
+	return CLI_SUCCESS;
 }
 
-static struct ast_translator evstolin = {
-	.table_cost = AST_TRANS_COST_LY_LL_ORIGSAMP,
-	.name = "evstolin",
-	.src_codec = {
-		.name = "evs",
-		.type = AST_MEDIA_TYPE_AUDIO,
-		.sample_rate = 16000,
-	},
-	.dst_codec = {
-		.name = "slin",
-		.type = AST_MEDIA_TYPE_AUDIO,
-		.sample_rate = 8000,
-	},
-	.format = "slin",
-	.newpvt = evstolin_new,
-	.framein = evstolin_framein,
-	.destroy = evstolin_destroy,
-	.sample = evs_sample,
-	.desc_size = sizeof(struct evs_coder_pvt),
-	.buffer_samples = BUFFER_SAMPLES / 2,
-	.buf_size = BUFFER_SAMPLES,
-};
+static int manager_evs_show_stats(struct mansession *s, const struct message *m)
+{
+	const char *id = astman_get_header(m, "ActionID");
+	char encoder_modes[512];
+	char decoder_modes[512];
+	struct evs_stats encoder;
+	struct evs_stats decoder;
 
-static struct ast_translator lintoevs = {
-	.table_cost = AST_TRANS_COST_LL_LY_ORIGSAMP,
-	.name = "lintoevs",
-	.src_codec = {
-		.name = "slin",
-		.type = AST_MEDIA_TYPE_AUDIO,
-		.sample_rate = 8000,
-	},
-	.dst_codec = {
-		.name = "evs",
-		.type = AST_MEDIA_TYPE_AUDIO,
-		.sample_rate = 16000,
-	},
-	.format = "evs",
-	.newpvt = lintoevs_new,
-	.framein = lintoevs_framein,
-	.frameout = lintoevs_frameout,
-	.destroy = lintoevs_destroy,
-	.sample = slin8_sample,
-	.desc_size = sizeof(struct evs_coder_pvt),
-	.buffer_samples = BUFFER_SAMPLES / 2,
-	.buf_size = BUFFER_SAMPLES,
-};
+	evs_stats_load(&evs_encoder_stats, &encoder);
+	evs_stats_load(&evs_decoder_stats, &decoder);
+	evs_stats_modes(&encoder, encoder_modes, sizeof(encoder_modes));
+	evs_stats_modes(&decoder, decoder_modes, sizeof(decoder_modes));
 
-static struct ast_translator evstolin16 = {
-	.table_cost = AST_TRANS_COST_LY_LL_ORIGSAMP - 1,
-	.name = "evstolin16",
-	.src_codec = {
-		.name = "evs",
-		.type = AST_MEDIA_TYPE_AUDIO,
-		.sample_rate = 16000,
-	},
-	.dst_codec = {
-		.name = "slin",
-		.type = AST_MEDIA_TYPE_AUDIO,
-		.sample_rate = 16000,
-	},
-	.format = "slin16",
-	.newpvt = evstolin_new,
-	.framein = evstolin_framein,
-	.destroy = evstolin_destroy,
-	.sample = evs_sample,
-	.desc_size = sizeof(struct evs_coder_pvt),
-	.buffer_samples = BUFFER_SAMPLES / 2,
-	.buf_size = BUFFER_SAMPLES,
-};
+	astman_append(s, "Response: Success\r\n");
+	if (!ast_strlen_zero(id)) {
+		astman_append(s, "ActionID: %s\r\n", id);
+	}
+	astman_append(s,
+		"EncoderActive: %u\r\n"
+		"EncoderFrames: %u\r\n"
+		"EncoderDTX: %u\r\n"
+		"EncoderCMR: %u\r\n"
+		"EncoderAvgTime: %llu\r\n"
+		"EncoderState: %lu\r\n"
+		"EncoderModes: %s\r\n"
+		"DecoderActive: %u\r\n"
+		"DecoderFrames: %u\r\n"
+		"DecoderDTX: %u\r\n"
+		"DecoderCMR: %u\r\n"
+		"DecoderConcealed: %u\r\n"
+		"DecoderCorrupt: %u\r\n"
+		"DecoderAvgTime: %llu\r\n"
+		"DecoderState: %lu\r\n"
+		"DecoderModes: %s\r\n"
+		"\r\n",
+		__atomic_load_n(&evs_encoders_active, __ATOMIC_RELAXED),
+		encoder.frames, evs_stats_dtx(&encoder), encoder.cmr,
+		encoder.frames ? encoder.ns / encoder.frames : 0, encoder.state, encoder_modes,
+		__atomic_load_n(&evs_decoders_active, __ATOMIC_RELAXED),
+		decoder.frames, evs_stats_dtx(&decoder), decoder.cmr, decoder.concealed,
+		decoder.corrupt, decoder.frames ? decoder.ns / decoder.frames : 0,
+		decoder.state, decoder_modes);
 
-static struct ast_translator lin16toevs = {
-	.table_cost = AST_TRANS_COST_LL_LY_ORIGSAMP - 1,
-	.name = "lin16toevs",
-	.src_codec = {
-		.name = "slin",
-		.type = AST_MEDIA_TYPE_AUDIO,
-		.sample_rate = 16000,
-	},
-	.dst_codec = {
-		.name = "evs",
-		.type = AST_MEDIA_TYPE_AUDIO,
-		.sample_rate = 16000,
-	},
-	.format = "evs",
-	.newpvt = lintoevs_new,
-	.framein = lintoevs_framein,
-	.frameout = lintoevs_frameout,
-	.destroy = lintoevs_destroy,
-	.sample = slin16_sample,
-	.desc_size = sizeof(struct evs_coder_pvt),
-	.buffer_samples = BUFFER_SAMPLES / 2,
-	.buf_size = BUFFER_SAMPLES,
-};
+	return 0;
+}
 
-static struct ast_translator evstolin32 = {
-	.table_cost = AST_TRANS_COST_LY_LL_ORIGSAMP - 2,
-	.name = "evstolin32",
-	.src_codec = {
-		.name = "evs",
-		.type = AST_MEDIA_TYPE_AUDIO,
-		.sample_rate = 16000,
-	},
-	.dst_codec = {
-		.name = "slin",
-		.type = AST_MEDIA_TYPE_AUDIO,
-		.sample_rate = 32000,
-	},
-	.format = "slin32",
-	.newpvt = evstolin_new,
-	.framein = evstolin_framein,
-	.destroy = evstolin_destroy,
-	.sample = evs_sample,
-	.desc_size = sizeof(struct evs_coder_pvt),
-	.buffer_samples = BUFFER_SAMPLES / 2,
-	.buf_size = BUFFER_SAMPLES,
+static struct ast_cli_entry cli_evs[] = {
+	AST_CLI_DEFINE(handle_cli_evs_show_stats, "Display 3GPP EVS statistics"),
+	AST_CLI_DEFINE(handle_cli_evs_benchmark, "Benchmark the 3GPP EVS translators"),
 };
 
-static struct ast_translator lin32toevs = {
-	.table_cost = AST_TRANS_COST_LL_LY_ORIGSAMP - 2,
-	.name = "lin32toevs",
-	.src_codec = {
-		.name = "slin",
-		.type = AST_MEDIA_TYPE_AUDIO,
-		.sample_rate = 32000,
-	},
-	.dst_codec = {
-		.name = "evs",
-		.type = AST_MEDIA_TYPE_AUDIO,
-		.sample_rate = 16000,
-	},
-	.format = "evs",
-	.newpvt = lintoevs_new,
-	.framein = lintoevs_framein,
-	.frameout = lintoevs_frameout,
-	.destroy = lintoevs_destroy,
-	.desc_size = sizeof(struct evs_coder_pvt),
-	.buffer_samples = BUFFER_SAMPLES / 2,
-	.buf_size = BUFFER_SAMPLES,
-};
+static int parse_config(int reload)
+{
+	struct ast_flags config_flags = { reload ? CONFIG_FLAG_FILEUNCHANGED : 0 };
+	struct ast_config *cfg = ast_config_load("codecs.conf", config_flags);
+	struct ast_variable *var;
+	unsigned int pool_max = DEFAULT_POOL_MAX;
+	unsigned int pool_prefill = DEFAULT_POOL_PREFILL;
+	unsigned int ptime = DEFAULT_PTIME;
+	int jbm = DEFAULT_JBM;
+	int rtcp_feedback = DEFAULT_RTCP_FEEDBACK;
+	int amrwb_octet_align = DEFAULT_AMRWB_OCTET_ALIGN;
+	unsigned int async_workers = DEFAULT_ASYNC_WORKERS;
+	int shared_encoder = DEFAULT_SHARED_ENCODER;
+	int prefer_16khz = DEFAULT_PREFER_16KHZ;
+	unsigned int val;
 
-static struct ast_translator evstolin48 = {
-	.table_cost = AST_TRANS_COST_LY_LL_ORIGSAMP - 4,
-	.name = "evstolin48",
-	.src_codec = {
-		.name = "evs",
-		.type = AST_MEDIA_TYPE_AUDIO,
-		.sample_rate = 16000,
-	},
-	.dst_codec = {
-		.name = "slin",
-		.type = AST_MEDIA_TYPE_AUDIO,
-		.sample_rate = 48000,
-	},
-	.format = "slin48",
-	.newpvt = evstolin_new,
-	.framein = evstolin_framein,
-	.destroy = evstolin_destroy,
-	.sample = evs_sample,
-	.desc_size = sizeof(struct evs_coder_pvt),
-	.buffer_samples = BUFFER_SAMPLES / 2,
-	.buf_size = BUFFER_SAMPLES,
-};
+	if (cfg == CONFIG_STATUS_FILEMISSING || cfg == CONFIG_STATUS_FILEUNCHANGED || cfg == CONFIG_STATUS_FILEINVALID) {
+		return 0;
+	}
 
-static struct ast_translator lin48toevs = {
-	.table_cost = AST_TRANS_COST_LL_LY_ORIGSAMP - 4,
-	.name = "lin48toevs",
-	.src_codec = {
-		.name = "slin",
-		.type = AST_MEDIA_TYPE_AUDIO,
-		.sample_rate = 48000,
-	},
-	.dst_codec = {
-		.name = "evs",
-		.type = AST_MEDIA_TYPE_AUDIO,
-		.sample_rate = 16000,
-	},
-	.format = "evs",
-	.newpvt = lintoevs_new,
-	.framein = lintoevs_framein,
-	.frameout = lintoevs_frameout,
-	.destroy = lintoevs_destroy,
-	.desc_size = sizeof(struct evs_coder_pvt),
-	.buffer_samples = BUFFER_SAMPLES / 2,
-	.buf_size = BUFFER_SAMPLES,
-};
+	for (var = ast_variable_browse(cfg, "evs"); var; var = var->next) {
+		if (!strcasecmp(var->name, "pool_max")) {
+			if (sscanf(var->value, "%30u", &val) == 1) {
+				pool_max = val;
+			} else {
+				ast_log(LOG_WARNING, "Invalid pool_max '%s'\n", var->value);
+			}
+		} else if (!strcasecmp(var->name, "pool_prefill")) {
+			if (sscanf(var->value, "%30u", &val) == 1) {
+				pool_prefill = val;
+			} else {
+				ast_log(LOG_WARNING, "Invalid pool_prefill '%s'\n", var->value);
+			}
+		} else if (!strcasecmp(var->name, "ptime")) {
+			if (sscanf(var->value, "%30u", &val) == 1 && 20 <= val && val <= EVS_MAX_FRAMES * 20) {
+				ptime = val;
+			} else {
+				ast_log(LOG_WARNING, "Invalid ptime '%s'\n", var->value);
+			}
+		} else if (!strcasecmp(var->name, "jbm")) {
+			jbm = ast_true(var->value);
+		} else if (!strcasecmp(var->name, "rtcp_feedback")) {
+			rtcp_feedback = ast_true(var->value);
+		} else if (!strcasecmp(var->name, "amrwb_octet_align")) {
+			amrwb_octet_align = ast_true(var->value);
+		} else if (!strcasecmp(var->name, "shared_encoder")) {
+			shared_encoder = ast_true(var->value);
+		} else if (!strcasecmp(var->name, "prefer_16khz")) {
+			prefer_16khz = ast_true(var->value);
+		} else if (!strcasecmp(var->name, "async_workers")) {
+			if (sscanf(var->value, "%30u", &val) == 1 && val <= MAX_ASYNC_WORKERS) {
+				async_workers = val;
+			} else {
+				ast_log(LOG_WARNING, "Invalid async_workers '%s'\n", var->value);
+			}
+		}
+	}
+	ast_config_destroy(cfg);
 
-static int evs_sample_counter(struct ast_frame *frame)
+	/* prefill is per sample rate; more than kept would be freed again */
+	evs_ptime = ptime;
+	evs_jbm = jbm; /* for new translator paths only */
+	evs_rtcp_feedback = rtcp_feedback;
+	evs_amrwb_octet_align = amrwb_octet_align;
+	evs_async_workers = async_workers; /* the workers start on load */
+	evs_shared_encoder = shared_encoder; /* for new translator paths only */
+	evs_prefer_16khz = prefer_16khz; /* the table costs are set on load */
+	evs_pool_max = pool_max;
+	evs_pool_prefill = MIN(pool_prefill, pool_max / 4);
+	evs_pool_trim(evs_pool_max);
+
+	return 0;
+}
+
+static int reload(void)
 {
-	return EVS_SAMPLES; /* ToDo: several frames per RTP payload (ToC) */
-	/* is this required? would limit Asterisk to Header-Full
-	 * format, because here the result of the SDP negotiation
-	 * is unknown. In Header-Full-only mode, the payloads are
-	 * not padded to identify the Compact format, see
-	 * 3GPP TS 26.445 A.2.3.2. Mhm, has anyone an idea? */
+	if (parse_config(1)) {
+		return AST_MODULE_LOAD_DECLINE;
+	}
+
+	return AST_MODULE_LOAD_SUCCESS;
 }
 
 static int unload_module(void)
 {
 	int res;
 
+	ast_cli_unregister_multiple(cli_evs, ARRAY_LEN(cli_evs));
+	ast_manager_unregister("EVSShowStats");
+	AST_TEST_UNREGISTER(evs_syn_output_test);
+	AST_TEST_UNREGISTER(evs_scaling_test);
+	AST_TEST_UNREGISTER(evs_scaling_realtime_test);
+	AST_TEST_UNREGISTER(evs_amr_wb_io_test);
+	AST_TEST_UNREGISTER(evs_shared_encoder_test);
+
 	if (evs_codec) {
 		evs_codec->samples_count = evs_previous_sample_counter;
-		evs_codec->maximum_ms = evs_previous_maximum_ms;
 		ao2_ref(evs_codec, -1);
 	}
 
@@ -787,14 +5074,30 @@ static int unload_module(void)
 	res |= ast_unregister_translator(&lin32toevs);
 	res |= ast_unregister_translator(&evstolin48);
 	res |= ast_unregister_translator(&lin48toevs);
+	if (evs_amrwb_registered) {
+		res |= ast_unregister_translator(&evstoamrwb);
+		res |= ast_unregister_translator(&amrwbtoevs);
+		evs_amrwb_registered = 0;
+	}
+
+	evs_pool_trim(0);
+	evs_async_stop();
 
 	return res;
 }
 
 static int load_module(void)
 {
+	struct ast_codec *amrwb_codec;
 	int res;
 
+	if (parse_config(0)) {
+		return AST_MODULE_LOAD_DECLINE;
+	}
+
+	evs_amr_wb_tables_init();
+	evs_syn_output_init();
+
 	evs_codec = ast_codec_get("evs", AST_MEDIA_TYPE_AUDIO, 16000);
 	if (NULL == evs_codec) {
 		ast_log(LOG_ERROR, "Please, apply the file 'codec_evs.patch'!\n");
@@ -802,8 +5105,6 @@ static int load_module(void)
 	}
 	evs_previous_sample_counter = evs_codec->samples_count;
 	evs_codec->samples_count = evs_sample_counter;
-	evs_previous_maximum_ms = evs_codec->maximum_ms;
-	evs_codec->maximum_ms = 20; /* ToDo: several frames per RTP payload */
 	/* A smoothable codec allows Asterisk to put several frame blocks
 	 * into one RTP packet, for example when the negotiated paketization
 	 * time (ptime) is 60ms. Frames of codecs like 3GPP EVS cannot be put
@@ -811,9 +5112,16 @@ static int load_module(void)
 	 * different length. Therefore, 3GPP EVS works with a Table of Contents.
 	 * Or stated differently: Smoothable works only with codecs which have
 	 * known fixed size, the same for each frame block. Commented because it
-	 * is set already, being non-smoothable is the default. */
+	 * is set already, being non-smoothable is the default. Instead, the
+	 * encoder puts several frames into one payload, see lintoevs_frameout. */
 	/* evs_codec->smooth = 0; */
 
+	evs_async_start(evs_async_workers);
+
+	if (evs_prefer_16khz) {
+		evs_table_costs_16khz();
+	}
+
 	res = ast_register_translator(&evstolin);
 	res |= ast_register_translator(&lintoevs);
 	res |= ast_register_translator(&evstolin16);
@@ -823,12 +5131,35 @@ static int load_module(void)
 	res |= ast_register_translator(&evstolin48);
 	res |= ast_register_translator(&lin48toevs);
 
+	/* The repacketizer requires a module for AMR-WB */
+	amrwb_codec = ast_codec_get("amrwb", AST_MEDIA_TYPE_AUDIO, 16000);
+	if (amrwb_codec) {
+		ao2_ref(amrwb_codec, -1);
+		res |= ast_register_translator(&evstoamrwb);
+		res |= ast_register_translator(&amrwbtoevs);
+		evs_amrwb_registered = 1;
+	}
+
 	if (res) {
 		unload_module();
 		return AST_MODULE_LOAD_DECLINE;
 	}
 
+	evs_pool_fill(evs_pool_prefill);
+	ast_cli_register_multiple(cli_evs, ARRAY_LEN(cli_evs));
+	ast_manager_register_xml("EVSShowStats", EVENT_FLAG_SYSTEM | EVENT_FLAG_REPORTING,
+		manager_evs_show_stats);
+	AST_TEST_REGISTER(evs_syn_output_test);
+	AST_TEST_REGISTER(evs_scaling_test);
+	AST_TEST_REGISTER(evs_scaling_realtime_test);
+	AST_TEST_REGISTER(evs_amr_wb_io_test);
+	AST_TEST_REGISTER(evs_shared_encoder_test);
+
 	return AST_MODULE_LOAD_SUCCESS;
 }
 
-AST_MODULE_INFO_STANDARD(ASTERISK_GPL_KEY, "3GPP EVS Coder/Decoder");
+AST_MODULE_INFO(ASTERISK_GPL_KEY, AST_MODFLAG_DEFAULT, "3GPP EVS Coder/Decoder",
+	.load = load_module,
+	.unload = unload_module,
+	.reload = reload,
+);
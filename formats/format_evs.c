@@ -0,0 +1,795 @@
+#include "asterisk.h"
+
+/* based on formats/format_ilbc.c */
+
+#include <errno.h>                      /* for errno */
+#include <fcntl.h>                      /* for O_APPEND, O_CREAT, etc */
+#include <stdlib.h>                     /* for mkdtemp */
+#include <string.h>                     /* for memcmp, strerror */
+#include <sys/stat.h>                   /* for fstat */
+#include <unistd.h>                     /* for ftruncate, pread, rmdir, etc */
+
+#include "asterisk/astobj2.h"           /* for ao2_alloc, ao2_find, etc */
+#include "asterisk/cli.h"               /* for ast_cli, ast_cli_entry, etc */
+#include "asterisk/file.h"              /* for ast_writefile, etc */
+#include "asterisk/format_cache.h"      /* for ast_format_evs */
+#include "asterisk/frame.h"             /* for ast_frame, etc */
+#include "asterisk/logger.h"            /* for ast_log, LOG_WARNING */
+#include "asterisk/mod_format.h"        /* for ast_filestream, etc */
+#include "asterisk/module.h"
+#include "asterisk/paths.h"             /* for ast_config_AST_DATA_DIR */
+#include "asterisk/test.h"              /* for AST_TEST_DEFINE, etc */
+#include "asterisk/utils.h"             /* for ARRAY_LEN, MAX */
+
+#include "asterisk/evs.h"               /* for evs_parse_payload, etc */
+
+/*
+ * MIME storage format, see 3GPP TS 26.445 A.2.6: a magic string and the
+ * number of channels, then one ToC byte per frame followed by its bits,
+ * padded to full bytes. The ToC has neither the Header Type nor the
+ * Followed bit set. Each frame is 20 ms, NO_DATA included.
+ */
+#define EVS_MAGIC        "#!EVS_MC1.0\n"
+#define EVS_MAGIC_SIZE   (sizeof(EVS_MAGIC) - 1)
+#define EVS_HEADER_SIZE  (EVS_MAGIC_SIZE + 4) /* channels, 32 bit */
+#define EVS_SAMPLES      320                  /* 20 ms at 16 kHz */
+#define EVS_FRAME_BYTES  (2560 / 8)           /* 128 kbps */
+/* ToC, frame, one byte padding to avoid the size of a Compact payload */
+#define EVS_BUF_SIZE     (1 + EVS_FRAME_BYTES + 1)
+
+/*
+ * Cache of prompts, shared by all streams which play the same file: the
+ * file is read into memory once; frames are copied from that snapshot
+ * instead of being read from the file. A file truncated or rewritten in
+ * place, for example by Record(), does not affect the streams which play
+ * the snapshot. An entry is identified by device and inode, and replaced
+ * when its file changed (size or modification time). Like all files, it
+ * is encoded at one mode; that mode is shown in the CLI. Only files below
+ * the data directory (sounds and MOH) are cached, not voicemail and other
+ * recordings, and only as long as all entries fit in EVS_CACHE_BYTES.
+ */
+#define EVS_CACHE_BUCKETS 61
+#define EVS_CACHE_BYTES   (64 * 1024 * 1024) /* unused entries are dropped then */
+
+/*
+ * Frames vary in size, therefore a mapping is indexed: the offset of
+ * every EVS_INDEX_STEP-th frame. A seek jumps to the nearest entry and
+ * walks the remaining frames. A jump starts exactly at the target: a
+ * format cannot discard the output of the decoder, so frames played
+ * before the target would be heard, and the position would be off. The
+ * decoder recovers from the jump itself within a few frames.
+ */
+#define EVS_INDEX_STEP    50            /* frames, one second */
+
+struct evs_mapping {
+	dev_t dev;
+	ino_t ino;
+	off_t size;
+	time_t mtime;
+	unsigned char *data;                /* snapshot, starts with the header */
+	unsigned char toc;                  /* of the first speech frame */
+	off_t frames;                       /* in the file, until a bad ToC */
+	off_t *index;                       /* see EVS_INDEX_STEP */
+	char name[0];
+};
+
+static struct ao2_container *evs_cache;
+static off_t evs_cache_bytes;           /* of all entries; with the lock of evs_cache */
+
+struct evs_desc {
+	off_t frames;                       /* position */
+	struct evs_mapping *map;            /* NULL when writing or on error */
+	off_t offset;                       /* position in map */
+	int writing;                        /* fs->f is write-only then */
+	FILE *reader;                       /* when writing, see evs_seek_frame */
+};
+
+static void evs_mapping_destructor(void *obj)
+{
+	struct evs_mapping *map = obj;
+
+	ast_free(map->data);
+	ast_free(map->index);
+}
+
+/* Counts the frames; fills the index and the mode, if index is set */
+static void evs_mapping_scan(struct evs_mapping *map, off_t *index)
+{
+	off_t offset = EVS_HEADER_SIZE;
+
+	for (map->frames = 0; offset < map->size; map->frames = map->frames + 1) {
+		const int bits = evs_toc_bits(map->data[offset]);
+
+		if (bits < 0 || map->size < offset + 1 + (bits + 7) / 8) {
+			break;
+		}
+		if (index && 0 == map->frames % EVS_INDEX_STEP) {
+			index[map->frames / EVS_INDEX_STEP] = offset;
+		}
+		if (EVS_NO_DATA == map->toc && 0 < bits &&
+				EVS_SPEECH_LOST != (map->data[offset] & EVS_FRAME_TYPE_MASK)) {
+			map->toc = map->data[offset];
+		}
+		offset = offset + 1 + (bits + 7) / 8;
+	}
+	if (index && 0 == map->frames % EVS_INDEX_STEP) {
+		index[map->frames / EVS_INDEX_STEP] = offset; /* the end */
+	}
+}
+
+static int evs_mapping_hash(const void *obj, const int flags)
+{
+	const struct evs_mapping *map = obj;
+
+	return (int) (map->ino & 0x7fffffff);
+}
+
+static int evs_mapping_cmp(void *obj, void *arg, int flags)
+{
+	const struct evs_mapping *map = obj;
+	const struct evs_mapping *key = arg;
+
+	return (map->dev == key->dev && map->ino == key->ino) ? CMP_MATCH : 0;
+}
+
+/* Only referenced by the cache itself; the callback adds no reference */
+static int evs_mapping_unused(void *obj, void *arg, int flags)
+{
+	struct evs_mapping *map = obj;
+
+	if (1 != ao2_ref(obj, 0)) {
+		return 0;
+	}
+	evs_cache_bytes = evs_cache_bytes - map->size;
+	return CMP_MATCH;
+}
+
+/* With the lock of evs_cache */
+static void evs_mapping_unlink(struct evs_mapping *map)
+{
+	ao2_unlink_flags(evs_cache, map, OBJ_NOLOCK);
+	evs_cache_bytes = evs_cache_bytes - map->size;
+}
+
+/* A prompt or MOH, see EVS_CACHE_BYTES */
+static int evs_mapping_cacheable(const char *name)
+{
+	const size_t length = strlen(ast_config_AST_DATA_DIR);
+
+	return name && !strncmp(name, ast_config_AST_DATA_DIR, length) && '/' == name[length];
+}
+
+/* Reads the whole file; a file truncated meanwhile ends there */
+static int evs_mapping_read(struct evs_mapping *map, int fd)
+{
+	off_t offset = 0;
+
+	while (offset < map->size) {
+		const ssize_t res = pread(fd, map->data + offset, map->size - offset, offset);
+
+		if (res < 0 && EINTR == errno) {
+			continue;
+		}
+		if (res < 0) {
+			ast_log(LOG_WARNING, "Unable to read EVS file (%s): %s\n", map->name,
+				strerror(errno));
+			return -1;
+		}
+		if (0 == res) {
+			break;
+		}
+		offset = offset + res;
+	}
+	map->size = offset;
+
+	return (map->size < EVS_HEADER_SIZE) ? -1 : 0;
+}
+
+/* With the lock of evs_cache: the entry of the file, if still valid */
+static struct evs_mapping *evs_mapping_find(const struct stat *st)
+{
+	struct evs_mapping key = { 0, };
+	struct evs_mapping *map;
+
+	key.dev = st->st_dev;
+	key.ino = st->st_ino;
+	map = ao2_find(evs_cache, &key, OBJ_SEARCH_OBJECT | OBJ_NOLOCK);
+	if (map && (map->size != st->st_size || map->mtime != st->st_mtime)) {
+		evs_mapping_unlink(map);
+		ao2_ref(map, -1);
+		map = NULL;
+	}
+
+	return map;
+}
+
+/* Finds or creates the mapping of an opened file; NULL if not possible */
+static struct evs_mapping *evs_mapping_get(struct ast_filestream *fs)
+{
+	const char *name = fs->realfilename ? fs->realfilename : fs->filename;
+	struct evs_mapping *map;
+	struct evs_mapping *found;
+	struct stat st;
+
+	if (!evs_cache || !evs_mapping_cacheable(name) || fstat(fileno(fs->f), &st) ||
+		st.st_size < EVS_HEADER_SIZE || EVS_CACHE_BYTES < st.st_size) {
+		return NULL;
+	}
+
+	ao2_lock(evs_cache);
+	map = evs_mapping_find(&st);
+	ao2_unlock(evs_cache);
+	if (map) {
+		return map;
+	}
+
+	/* Read without the lock; other files are opened meanwhile */
+	map = ao2_alloc(sizeof(*map) + strlen(name) + 1, evs_mapping_destructor);
+	if (!map) {
+		return NULL;
+	}
+	strcpy(map->name, name); /* Safe */
+	map->dev = st.st_dev;
+	map->ino = st.st_ino;
+	map->size = st.st_size;
+	map->mtime = st.st_mtime;
+	map->toc = EVS_NO_DATA;
+	map->data = ast_malloc(map->size);
+	if (!map->data || evs_mapping_read(map, fileno(fs->f))) {
+		ao2_ref(map, -1);
+		return NULL;
+	}
+
+	evs_mapping_scan(map, NULL);
+	map->index = ast_malloc((map->frames / EVS_INDEX_STEP + 1) * sizeof(*map->index));
+	if (!map->index) {
+		ao2_ref(map, -1);
+		return NULL;
+	}
+	evs_mapping_scan(map, map->index);
+
+	/* Another stream might have read the same file meanwhile */
+	ao2_lock(evs_cache);
+	found = evs_mapping_find(&st);
+	if (!found) {
+		if (EVS_CACHE_BYTES < evs_cache_bytes + map->size) {
+			ao2_callback(evs_cache, OBJ_NOLOCK | OBJ_UNLINK | OBJ_MULTIPLE | OBJ_NODATA,
+				evs_mapping_unused, NULL);
+		}
+		/* Otherwise, this stream plays its snapshot alone */
+		if (evs_cache_bytes + map->size <= EVS_CACHE_BYTES) {
+			ao2_link_flags(evs_cache, map, OBJ_NOLOCK);
+			evs_cache_bytes = evs_cache_bytes + map->size;
+		}
+	}
+	ao2_unlock(evs_cache);
+
+	if (found) {
+		ao2_ref(map, -1);
+		return found;
+	}
+
+	return map;
+}
+
+static int evs_open(struct ast_filestream *fs)
+{
+	struct evs_desc *desc = fs->_private;
+	unsigned char header[EVS_HEADER_SIZE];
+	unsigned int channels;
+
+	if (fread(header, 1, sizeof(header), fs->f) != sizeof(header) ||
+		memcmp(header, EVS_MAGIC, EVS_MAGIC_SIZE)) {
+		ast_log(LOG_WARNING, "Not an EVS file (%s)\n", fs->filename);
+		return -1;
+	}
+
+	channels = (header[EVS_MAGIC_SIZE + 0] << 24) | (header[EVS_MAGIC_SIZE + 1] << 16) |
+		(header[EVS_MAGIC_SIZE + 2] << 8) | header[EVS_MAGIC_SIZE + 3];
+	if (1 != channels) {
+		ast_log(LOG_WARNING, "EVS file with %u channels is not supported (%s)\n",
+			channels, fs->filename);
+		return -1;
+	}
+
+	desc->frames = 0;
+	desc->map = evs_mapping_get(fs); /* otherwise, read via fs->f */
+	desc->offset = EVS_HEADER_SIZE;
+	return 0;
+}
+
+static void evs_close(struct ast_filestream *fs)
+{
+	struct evs_desc *desc = fs->_private;
+
+	ao2_cleanup(desc->map);
+	desc->map = NULL;
+	if (desc->reader) {
+		fclose(desc->reader);
+		desc->reader = NULL;
+	}
+}
+
+static int evs_rewrite(struct ast_filestream *fs, const char *comment)
+{
+	static const unsigned char channels[4] = { 0x00, 0x00, 0x00, 0x01 };
+	struct evs_desc *desc = fs->_private;
+
+	if (fwrite(EVS_MAGIC, 1, EVS_MAGIC_SIZE, fs->f) != EVS_MAGIC_SIZE ||
+		fwrite(channels, 1, sizeof(channels), fs->f) != sizeof(channels)) {
+		ast_log(LOG_WARNING, "Unable to write EVS header: %s\n", strerror(errno));
+		return -1;
+	}
+
+	desc->frames = 0;
+	desc->writing = 1;
+	return 0;
+}
+
+/*
+ * A write stream opens its file write-only, see ast_writefile. To walk
+ * the ToCs, for example to append or to rewind, the file is opened again
+ * for reading, by the same name as the core built it.
+ */
+static FILE *evs_reader(struct ast_filestream *fs)
+{
+	struct evs_desc *desc = fs->_private;
+	char *name;
+
+	if (desc->reader) {
+		return desc->reader;
+	}
+
+	if ('/' == fs->filename[0]) {
+		name = ast_alloca(strlen(fs->filename) + strlen(".evs") + 1);
+		sprintf(name, "%s.evs", fs->filename); /* Safe */
+	} else {
+		name = ast_alloca(strlen(ast_config_AST_DATA_DIR) + strlen("/sounds/") +
+			strlen(fs->filename) + strlen(".evs") + 1);
+		sprintf(name, "%s/sounds/%s.evs", ast_config_AST_DATA_DIR, fs->filename); /* Safe */
+	}
+	desc->reader = fopen(name, "r");
+	if (!desc->reader) {
+		ast_log(LOG_WARNING, "Unable to open EVS file (%s) for seeking: %s\n", name,
+			strerror(errno));
+	}
+
+	return desc->reader;
+}
+
+/* Reads the ToC of the next frame; -1 at the end of the file */
+static int evs_read_toc(struct ast_filestream *fs, FILE *f, unsigned char *toc, int *bytes)
+{
+	struct evs_desc *desc = fs->_private;
+	int bits;
+
+	if (desc->map) {
+		if (desc->map->size <= desc->offset) {
+			return -1;
+		}
+		*toc = desc->map->data[desc->offset];
+	} else if (fread(toc, 1, 1, f) != 1) {
+		return -1;
+	}
+
+	bits = evs_toc_bits(*toc);
+	if (bits < 0 || (*toc & (EVS_HEADER_TYPE_BIT | EVS_FOLLOWED_BIT))) {
+		ast_log(LOG_WARNING, "Invalid ToC 0x%02x in EVS file (%s)\n", *toc, fs->filename);
+		return -1;
+	}
+	*bytes = (bits + 7) / 8;
+	if (desc->map && desc->map->size < desc->offset + 1 + *bytes) {
+		return -1; /* truncated */
+	}
+
+	return 0;
+}
+
+static struct ast_frame *evs_read(struct ast_filestream *fs, int *whennext)
+{
+	struct evs_desc *desc = fs->_private;
+	unsigned char *payload;
+	int bytes;
+	int res;
+
+	AST_FRAME_SET_BUFFER(&fs->fr, fs->buf, AST_FRIENDLY_OFFSET, EVS_BUF_SIZE);
+	payload = fs->fr.data.ptr;
+
+	if (evs_read_toc(fs, fs->f, &payload[0], &bytes)) {
+		return NULL;
+	}
+	/* Copied into the buffer of the stream, which has the headroom of
+	 * AST_FRIENDLY_OFFSET; the core copies each frame again anyway */
+	if (desc->map) {
+		memcpy(payload + 1, desc->map->data + desc->offset + 1, bytes);
+		desc->offset = desc->offset + 1 + bytes;
+	} else if ((res = fread(payload + 1, 1, bytes, fs->f)) != bytes) {
+		if (res) {
+			ast_log(LOG_WARNING, "Short read (%d) (%s)!\n", res, strerror(errno));
+		}
+		return NULL;
+	}
+
+	/* Header-Full payload with one frame; padded, if its size would be
+	 * taken as Compact format, see 3GPP TS 26.445 A.2.3.2 */
+	fs->fr.datalen = 1 + bytes;
+	while (0 <= evs_compact_toc(fs->fr.datalen)) {
+		payload[fs->fr.datalen] = 0x00;
+		fs->fr.datalen = fs->fr.datalen + 1;
+	}
+
+	desc->frames = desc->frames + 1;
+	*whennext = fs->fr.samples = EVS_SAMPLES;
+	return &fs->fr;
+}
+
+static int evs_write(struct ast_filestream *fs, struct ast_frame *f)
+{
+	struct evs_desc *desc = fs->_private;
+	struct evs_attr *attr = ast_format_get_attribute_data(f->subclass.format);
+	struct evs_payload_frame frames[EVS_MAX_FRAMES];
+	unsigned char cmr;
+	int count;
+	int i;
+
+	if (0 == f->datalen) {
+		return 0;
+	}
+
+	count = evs_parse_payload(f->data.ptr, f->datalen, attr ? attr->hf_only : -1,
+		&cmr, frames, ARRAY_LEN(frames));
+	if (count < 0) {
+		ast_log(LOG_WARNING, "Invalid EVS payload of %d bytes\n", f->datalen);
+		return -1;
+	}
+
+	for (i = 0; i < count; i = i + 1) {
+		const unsigned char toc = frames[i].toc & (EVS_MODE_BIT | EVS_QUALITY_BIT | EVS_FRAME_TYPE_MASK);
+		const int bytes = (evs_toc_bits(toc) + 7) / 8;
+		unsigned char data[EVS_FRAME_BYTES];
+		const unsigned char *frame = frames[i].data;
+		int j;
+
+		/* Compact AMR-WB IO starts with a CMR of 3 bits */
+		if (frames[i].offset) {
+			const int shift = frames[i].offset;
+
+			for (j = 0; j < bytes - 1; j = j + 1) {
+				data[j] = (frame[j] << shift) | (frame[j + 1] >> (8 - shift));
+			}
+			/* No bits beyond the frame, see evs_compact_toc */
+			data[bytes - 1] = frame[bytes - 1] << shift;
+			frame = data;
+		}
+
+		if (fwrite(&toc, 1, 1, fs->f) != 1 ||
+			fwrite(frame, 1, bytes, fs->f) != bytes) {
+			ast_log(LOG_WARNING, "Bad write (%d): %s\n", bytes, strerror(errno));
+			return -1;
+		}
+		desc->frames = desc->frames + 1;
+	}
+
+	return 0;
+}
+
+/* Frames vary in size; each one has to be passed by its ToC.
+ * Stops at the end of the file; frames < 0 seeks to the end. */
+static int evs_seek_frame(struct ast_filestream *fs, off_t frames)
+{
+	struct evs_desc *desc = fs->_private;
+	FILE *f = fs->f;
+	unsigned char frame[EVS_FRAME_BYTES];
+	unsigned char toc;
+	int bytes;
+
+	if (desc->map) {
+		off_t entry;
+
+		if (frames < 0 || desc->map->frames < frames) {
+			frames = desc->map->frames;
+		}
+		entry = frames / EVS_INDEX_STEP;
+		if (frames < desc->frames || desc->frames / EVS_INDEX_STEP < entry) {
+			desc->offset = desc->map->index[entry];
+			desc->frames = entry * EVS_INDEX_STEP;
+		}
+	} else if (desc->writing) {
+		/* Walks from the start, then moves the writer to that frame */
+		f = evs_reader(fs);
+		if (!f || fflush(fs->f) || fseeko(f, EVS_HEADER_SIZE, SEEK_SET)) {
+			return -1;
+		}
+		clearerr(f);
+		desc->frames = 0;
+	} else if (0 <= frames && frames < desc->frames) {
+		if (fseeko(f, EVS_HEADER_SIZE, SEEK_SET)) {
+			return -1;
+		}
+		desc->frames = 0;
+		desc->offset = EVS_HEADER_SIZE;
+	}
+
+	while (frames < 0 || desc->frames < frames) {
+		const off_t start = desc->map ? desc->offset : ftello(f);
+
+		if (evs_read_toc(fs, f, &toc, &bytes) ||
+			(!desc->map && fread(frame, 1, bytes, f) != bytes)) {
+			/* At the end or truncated; a writer overwrites from there */
+			if (!desc->map && (start < 0 || fseeko(f, start, SEEK_SET))) {
+				return -1;
+			}
+			break;
+		}
+		if (desc->map) {
+			desc->offset = desc->offset + 1 + bytes;
+		}
+		desc->frames = desc->frames + 1;
+	}
+
+	/* The next frame is written after the last complete one */
+	if (desc->writing) {
+		const off_t offset = ftello(f);
+
+		if (offset < 0 || fseeko(fs->f, offset, SEEK_SET)) {
+			return -1;
+		}
+	}
+
+	return 0;
+}
+
+static int evs_seek(struct ast_filestream *fs, off_t sample_offset, int whence)
+{
+	struct evs_desc *desc = fs->_private;
+	off_t frames = sample_offset / EVS_SAMPLES;
+
+	if (SEEK_END == whence) {
+		if (evs_seek_frame(fs, -1)) {
+			return -1;
+		}
+		if (0 == frames) {
+			return 0;
+		}
+	}
+	if (SEEK_SET != whence) {
+		/* SEEK_CUR, SEEK_FORCECUR, and SEEK_END from the current position */
+		frames = desc->frames + frames;
+	}
+	return evs_seek_frame(fs, MAX(0, frames));
+}
+
+static int evs_trunc(struct ast_filestream *fs)
+{
+	int fd;
+	off_t cur;
+
+	if ((fd = fileno(fs->f)) < 0) {
+		ast_log(LOG_WARNING, "Unable to determine file descriptor for EVS filestream %p: %s\n", fs, strerror(errno));
+		return -1;
+	}
+	if ((cur = ftello(fs->f)) < 0) {
+		ast_log(LOG_WARNING, "Unable to determine current position in EVS filestream %p: %s\n", fs, strerror(errno));
+		return -1;
+	}
+	/* Truncate file to current length */
+	return ftruncate(fd, cur);
+}
+
+static off_t evs_tell(struct ast_filestream *fs)
+{
+	struct evs_desc *desc = fs->_private;
+
+	return desc->frames * EVS_SAMPLES;
+}
+
+static struct ast_format_def evs_f = {
+	.name = "evs",
+	.exts = "evs",
+	.open = evs_open,
+	.rewrite = evs_rewrite,
+	.write = evs_write,
+	.seek = evs_seek,
+	.trunc = evs_trunc,
+	.tell = evs_tell,
+	.read = evs_read,
+	.close = evs_close,
+	.buf_size = EVS_BUF_SIZE + AST_FRIENDLY_OFFSET,
+	.desc_size = sizeof(struct evs_desc),
+};
+
+static char *handle_cli_evs_show_cache(struct ast_cli_entry *e, int cmd, struct ast_cli_args *a)
+{
+	struct ao2_iterator i;
+	struct evs_mapping *map;
+
+	switch (cmd) {
+	case CLI_INIT:
+		e->command = "evs show cache";
+		e->usage =
+			"Usage: evs show cache\n"
+			"       Lists the EVS files read into memory, with the\n"
+			"       number of streams playing each file. Only prompts\n"
+			"       and MOH below the data directory are cached.\n";
+		return NULL;
+	case CLI_GENERATE:
+		return NULL;
+	}
+
+	if (a->argc != 3) {
+		return CLI_SHOWUSAGE;
+	}
+
+	ao2_lock(evs_cache);
+	ast_cli(a->fd, "%ld of %d bytes cached\n", (long) evs_cache_bytes, EVS_CACHE_BYTES);
+	ao2_unlock(evs_cache);
+	ast_cli(a->fd, "%-9s %-6s %10s %7s  %s\n", "Mode", "Type", "Bytes", "Streams", "File");
+	i = ao2_iterator_init(evs_cache, 0);
+	while ((map = ao2_iterator_next(&i))) {
+		const int type = map->toc & EVS_FRAME_TYPE_MASK;
+
+		/* -2: reference of the cache and of this iterator */
+		ast_cli(a->fd, "%-9s %-6d %10ld %7d  %s\n",
+			(map->toc & EVS_MODE_BIT) ? "AMR-WB IO" : "EVS", type,
+			(long) map->size, ao2_ref(map, 0) - 2, map->name);
+		ao2_ref(map, -1);
+	}
+	ao2_iterator_destroy(&i);
+
+	return CLI_SUCCESS;
+}
+
+static struct ast_cli_entry cli_evs_format[] = {
+	AST_CLI_DEFINE(handle_cli_evs_show_cache, "Display the cache of EVS files"),
+};
+
+#ifdef TEST_FRAMEWORK
+/*
+ * Record() and MixMonitor() append via ast_writefile with O_APPEND and
+ * ast_seekstream to SEEK_END; the frames of both recordings must be read
+ * back in order.
+ */
+#define APPEND_FRAMES 60
+
+static int evs_append_write(const char *name, int flags, int first, struct ast_test *test)
+{
+	struct ast_filestream *fs = ast_writefile(name, "evs", NULL, flags, 0, 0600);
+	unsigned char payload[EVS_BUF_SIZE];
+	int res = 0;
+	int i;
+
+	if (!fs) {
+		ast_test_status_update(test, "Unable to write %s.evs\n", name);
+		return -1;
+	}
+
+	if ((flags & O_APPEND) && (ast_seekstream(fs, 0, SEEK_END) ||
+			ast_tellstream(fs) != APPEND_FRAMES * EVS_SAMPLES)) {
+		ast_test_status_update(test, "Not at the end of %s.evs but at sample %ld\n",
+			name, (long) ast_tellstream(fs));
+		res = -1;
+	}
+
+	for (i = first; i < first + APPEND_FRAMES && !res; i = i + 1) {
+		struct ast_frame f = {
+			.frametype = AST_FRAME_VOICE,
+			.subclass.format = ast_format_evs,
+			.samples = EVS_SAMPLES,
+			.src = "evs append",
+			.data.ptr = payload,
+		};
+
+		/* 13.2 kbps, numbered by its first byte; padded as in evs_read */
+		memset(payload, 0, sizeof(payload));
+		payload[0] = 0x04;
+		payload[1] = i;
+		f.datalen = 1 + (evs_toc_bits(payload[0]) + 7) / 8;
+		while (0 <= evs_compact_toc(f.datalen)) {
+			f.datalen = f.datalen + 1;
+		}
+		res = ast_writestream(fs, &f);
+	}
+	ast_closestream(fs);
+
+	return res;
+}
+
+AST_TEST_DEFINE(evs_append_test)
+{
+	char dir[] = "/tmp/evs_append_XXXXXX";
+	char name[sizeof(dir) + sizeof("/recording")];
+	char file[sizeof(name) + sizeof(".evs")];
+	enum ast_test_result_state res = AST_TEST_FAIL;
+	struct ast_filestream *fs;
+	struct ast_frame *f;
+	int frames = 0;
+
+	switch (cmd) {
+	case TEST_INIT:
+		info->name = "append";
+		info->category = "/formats/evs/";
+		info->summary = "Append to an EVS recording";
+		info->description =
+			"Records frames, then appends more as Record() with the option a "
+			"does; all frames must be read back in order.";
+		return AST_TEST_NOT_RUN;
+	case TEST_EXECUTE:
+		break;
+	}
+
+	if (!mkdtemp(dir)) {
+		ast_test_status_update(test, "Unable to create %s: %s\n", dir, strerror(errno));
+		return AST_TEST_FAIL;
+	}
+	snprintf(name, sizeof(name), "%s/recording", dir);
+	snprintf(file, sizeof(file), "%s.evs", name);
+
+	if (!evs_append_write(name, O_CREAT | O_TRUNC | O_WRONLY, 0, test) &&
+		!evs_append_write(name, O_CREAT | O_APPEND | O_WRONLY, APPEND_FRAMES, test) &&
+		(fs = ast_readfile(name, "evs", NULL, O_RDONLY, 0, 0))) {
+		while ((f = ast_readframe(fs))) {
+			if (((unsigned char *) f->data.ptr)[1] != (frames & 0xff)) {
+				ast_test_status_update(test, "Frame %d read as frame %d\n",
+					((unsigned char *) f->data.ptr)[1], frames);
+				break;
+			}
+			ast_frfree(f);
+			frames = frames + 1;
+		}
+		if (f) {
+			ast_frfree(f);
+		}
+		ast_closestream(fs);
+
+		ast_test_status_update(test, "%d of %d frames read back\n", frames, 2 * APPEND_FRAMES);
+		if (2 * APPEND_FRAMES == frames) {
+			res = AST_TEST_PASS;
+		}
+	}
+
+	unlink(file);
+	rmdir(dir);
+
+	return res;
+}
+#endif
+
+static int load_module(void)
+{
+	evs_cache = ao2_container_alloc_hash(AO2_ALLOC_OPT_LOCK_MUTEX, 0,
+		EVS_CACHE_BUCKETS, evs_mapping_hash, NULL, evs_mapping_cmp);
+	if (!evs_cache) {
+		return AST_MODULE_LOAD_DECLINE;
+	}
+
+	evs_f.format = ast_format_evs;
+	if (ast_format_def_register(&evs_f)) {
+		ao2_ref(evs_cache, -1);
+		evs_cache = NULL;
+		return AST_MODULE_LOAD_FAILURE;
+	}
+	ast_cli_register_multiple(cli_evs_format, ARRAY_LEN(cli_evs_format));
+	AST_TEST_REGISTER(evs_append_test);
+
+	return AST_MODULE_LOAD_SUCCESS;
+}
+
+static int unload_module(void)
+{
+	int res;
+
+	AST_TEST_UNREGISTER(evs_append_test);
+	ast_cli_unregister_multiple(cli_evs_format, ARRAY_LEN(cli_evs_format));
+	res = ast_format_def_unregister(evs_f.name);
+	/* Streams still playing keep their mapping */
+	ao2_cleanup(evs_cache);
+	evs_cache = NULL;
+
+	return res;
+}
+
+AST_MODULE_INFO(ASTERISK_GPL_KEY, AST_MODFLAG_LOAD_ORDER, "3GPP EVS MIME Storage Format",
+	.load = load_module,
+	.unload = unload_module,
+	.load_pri = AST_MODPRI_APP_DEPEND,
+);
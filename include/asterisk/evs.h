@@ -1,6 +1,16 @@
 #ifndef _AST_FORMAT_EVS_H_
 #define _AST_FORMAT_EVS_H_
 
+/*
+ * Change-Mode Requests (CMR) received by the decoder of a call, for the
+ * encoder of the same call. Both translators see a clone of the joint
+ * format; each clone references the same mailbox, see evs_getjoint.
+ * Accessed with atomic operations only, no lock on the media path.
+ */
+struct evs_mailbox {
+	unsigned int mode; /* EVS_NO_REQ until the first CMR */
+};
+
 struct evs_attr {
 	/* EVS modes
 	 * -1 primary mode; not included in SDP because default
@@ -60,7 +70,173 @@ struct evs_attr {
 	unsigned int mode_change_period;
 	unsigned int mode_change_neighbor;
 	/* internal variables for transcoding module */
-	unsigned char mode_current; /* see evs_clone for default */
+	unsigned char mode_current; /* initial mode, see evs_getjoint */
+	struct evs_mailbox *mailbox; /* ao2 object, shared by the clones */
+	/* Packetization time in ms; a=ptime and a=maxptime are not part of
+	 * the fmtp line but can be set via ast_format_attribute_set
+	 * 0 not specified; codecs.conf [evs] ptime applies */
+	unsigned int ptime;
+	unsigned int maxptime;
+};
+
+/* RTP payload, see 3GPP TS 26.445 Annex A */
+#define EVS_HEADER_TYPE_BIT  0x80 /* Header Type: 1 = CMR, 0 = ToC      */
+#define EVS_FOLLOWED_BIT     0x40 /* another ToC follows                 */
+#define EVS_MODE_BIT         0x20 /* 1 = AMR-WB IO mode, 0 = primary     */
+#define EVS_QUALITY_BIT      0x10 /* 0 = damaged AMR-WB IO frame         */
+#define EVS_FRAME_TYPE_MASK  0x0f /* bit-rate                            */
+#define EVS_NO_REQ           0xff /* CMR: no change in mode requested    */
+#define EVS_SPEECH_LOST      0x0e /* frame type                          */
+#define EVS_NO_DATA          0x0f /* frame type                          */
+#define EVS_MAX_FRAMES       15   /* 300 ms, see codec_evs.patch         */
+
+struct evs_payload_frame {
+	unsigned char toc;
+	const unsigned char *data;
+	unsigned char offset; /* bits before the frame, 3 = CMR of Compact AMR-WB IO */
 };
 
+/*!
+ * \brief Size of a frame as given by its ToC
+ * \retval number of bits; -1 if the frame type is reserved
+ */
+static inline int evs_toc_bits(unsigned char toc)
+{
+	static const short primary[16] = {
+		56, 144, 160, 192, 264, 328, 488, 640, 960, 1280, 1920, 2560,
+		48, -1, 0, 0 };
+	static const short amr_wb_io[16] = {
+		132, 177, 253, 285, 317, 365, 397, 461, 477,
+		40, -1, -1, -1, -1, 0, 0 };
+
+	if (toc & EVS_MODE_BIT) {
+		return amr_wb_io[toc & EVS_FRAME_TYPE_MASK];
+	} else {
+		return primary[toc & EVS_FRAME_TYPE_MASK];
+	}
+}
+
+/*!
+ * \brief Splits a Header-Full payload into its frames
+ * \param cmr is set to the Change-Mode Request; EVS_NO_REQ if none
+ * \retval number of frames; -1 if the payload is corrupted
+ */
+static inline int evs_parse_header_full(const unsigned char *payload, int length,
+	unsigned char *cmr, struct evs_payload_frame *frames, int max_frames)
+{
+	const unsigned char *data;
+	int count = 0;
+	int i;
+
+	*cmr = EVS_NO_REQ;
+	if (0 < length && (payload[0] & EVS_HEADER_TYPE_BIT)) {
+		*cmr = payload[0];
+		payload = payload + 1;
+		length = length - 1;
+	}
+
+	/* Table of Contents (ToC): one byte per frame */
+	do {
+		if (count == length || count == max_frames) {
+			return -1;
+		}
+		if (payload[count] & EVS_HEADER_TYPE_BIT) {
+			return -1; /* 2nd CMR */
+		}
+		frames[count].toc = payload[count];
+		count = count + 1;
+	} while (payload[count - 1] & EVS_FOLLOWED_BIT);
+
+	data = payload + count;
+	length = length - count;
+	for (i = 0; i < count; i = i + 1) {
+		const int bits = evs_toc_bits(frames[i].toc);
+		const int bytes = (bits + 7) / 8;
+
+		if (bits < 0 || length < bytes) {
+			return -1;
+		}
+		frames[i].data = data;
+		frames[i].offset = 0;
+		data = data + bytes;
+		length = length - bytes;
+	}
+
+	return count;
+}
+
+/*!
+ * \brief Frame type of a Compact payload, identified by its size only,
+ *        see 3GPP TS 26.445 A.2.1 and A.2.3.2
+ * \retval ToC of the frame; -1 if the size is not one of the Compact format
+ */
+static inline int evs_compact_toc(int length)
+{
+	/* Indexed by bytes; the Header Type bit marks a valid entry */
+	static const unsigned char compact[321] = {
+		[  5] = 0x80 | EVS_MODE_BIT | EVS_QUALITY_BIT | 9, /* AMR-WB IO SID */
+		[  6] = 0x80 | 12, /* SID */
+		[  7] = 0x80 |  0, /*  2.8 */
+		[ 17] = 0x80 | EVS_MODE_BIT | EVS_QUALITY_BIT | 0, /*  6.60 */
+		[ 18] = 0x80 |  1, /*  7.2 */
+		[ 20] = 0x80 |  2, /*  8.0 */
+		[ 23] = 0x80 | EVS_MODE_BIT | EVS_QUALITY_BIT | 1, /*  8.85 */
+		[ 24] = 0x80 |  3, /*  9.6 */
+		[ 32] = 0x80 | EVS_MODE_BIT | EVS_QUALITY_BIT | 2, /* 12.65 */
+		[ 33] = 0x80 |  4, /* 13.2 */
+		[ 36] = 0x80 | EVS_MODE_BIT | EVS_QUALITY_BIT | 3, /* 14.25 */
+		[ 40] = 0x80 | EVS_MODE_BIT | EVS_QUALITY_BIT | 4, /* 15.85 */
+		[ 41] = 0x80 |  5, /* 16.4 */
+		[ 46] = 0x80 | EVS_MODE_BIT | EVS_QUALITY_BIT | 5, /* 18.25 */
+		[ 50] = 0x80 | EVS_MODE_BIT | EVS_QUALITY_BIT | 6, /* 19.85 */
+		[ 58] = 0x80 | EVS_MODE_BIT | EVS_QUALITY_BIT | 7, /* 23.05 */
+		[ 60] = 0x80 | EVS_MODE_BIT | EVS_QUALITY_BIT | 8, /* 23.85 */
+		[ 61] = 0x80 |  6, /* 24.4 */
+		[ 80] = 0x80 |  7, /* 32 */
+		[120] = 0x80 |  8, /* 48 */
+		[160] = 0x80 |  9, /* 64 */
+		[240] = 0x80 | 10, /* 96 */
+		[320] = 0x80 | 11, /* 128 */
+	};
+
+	if (length < 0 || (int) sizeof(compact) <= length || !(compact[length] & 0x80)) {
+		return -1;
+	}
+
+	return compact[length] & ~0x80;
+}
+
+/*!
+ * \brief Splits a payload into its frames, Compact or Header-Full format
+ * \param hf_only as negotiated; when 1, the payload is not checked for Compact
+ * \param cmr is set to the Change-Mode Request; EVS_NO_REQ if none
+ * \retval number of frames; -1 if the payload is corrupted
+ */
+static inline int evs_parse_payload(const unsigned char *payload, int length,
+	int hf_only, unsigned char *cmr, struct evs_payload_frame *frames, int max_frames)
+{
+	/* CMR of Compact AMR-WB IO, see 3GPP TS 26.445 Table A.3 */
+	static const unsigned char compact_cmr[8] = {
+		0x90, 0x91, 0x92, 0x94, 0x95, 0x97, 0x98, EVS_NO_REQ };
+	const int toc = (1 == hf_only) ? -1 : evs_compact_toc(length);
+
+	if (toc < 0) {
+		return evs_parse_header_full(payload, length, cmr, frames, max_frames);
+	}
+	if (max_frames < 1) {
+		return -1;
+	}
+
+	*cmr = EVS_NO_REQ;
+	frames[0].toc = toc;
+	frames[0].data = payload;
+	frames[0].offset = 0;
+	if (toc & EVS_MODE_BIT) {
+		*cmr = compact_cmr[payload[0] >> 5];
+		frames[0].offset = 3;
+	}
+
+	return 1;
+}
+
 #endif /* _AST_FORMAT_EVS_H */
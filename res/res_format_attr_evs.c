@@ -51,6 +51,7 @@ static void evs_destroy(struct ast_format *format)
 {
 	struct evs_attr *attr = ast_format_get_attribute_data(format);
 
+	ao2_cleanup(attr->mailbox);
 	ast_free(attr);
 }
 
@@ -65,6 +66,7 @@ static int evs_clone(const struct ast_format *src, struct ast_format *dst)
 
 	if (original) {
 		*attr = *original;
+		ao2_bump(attr->mailbox);
 	} else {
 		*attr = default_evs_attr;
 	}
@@ -140,6 +142,35 @@ unsigned int evs_parse_sdp_fmtp_bw(const char *res)
 	}
 }
 
+static struct ast_format *evs_set(const struct ast_format *format, const char *name, const char *value)
+{
+	struct ast_format *cloned;
+	struct evs_attr *attr;
+	unsigned int val;
+
+	if (sscanf(value, "%30u", &val) != 1) {
+		ast_log(LOG_WARNING, "Unable to parse value '%s' for attribute type '%s'\n",
+			value, name);
+		return NULL;
+	}
+
+	cloned = ast_format_clone(format);
+	if (!cloned) {
+		return NULL;
+	}
+	attr = ast_format_get_attribute_data(cloned);
+
+	if (!strcasecmp(name, "ptime")) {
+		attr->ptime = val;
+	} else if (!strcasecmp(name, "maxptime")) {
+		attr->maxptime = val;
+	} else {
+		ast_log(LOG_WARNING, "unknown attribute type %s\n", name);
+	}
+
+	return cloned;
+}
+
 static struct ast_format *evs_parse_sdp_fmtp(const struct ast_format *format, const char *attrib)
 {
 	struct ast_format *cloned;
@@ -838,6 +869,13 @@ static struct ast_format *evs_getjoint(const struct ast_format *format1, const s
 	attr_res->ch_aw_send = MIN(attr1->ch_aw_send, attr2->ch_aw_send);
 	attr_res->ch_aw_recv = MAX(attr1->ch_aw_recv, attr2->ch_aw_recv);
 
+	attr_res->ptime = MAX(attr1->ptime, attr2->ptime);
+	if (attr1->maxptime && attr2->maxptime) {
+		attr_res->maxptime = MIN(attr1->maxptime, attr2->maxptime);
+	} else {
+		attr_res->maxptime = MAX(attr1->maxptime, attr2->maxptime);
+	}
+
 	attr_res->mode_change_period = MAX(attr1->mode_change_period, attr2->mode_change_period);
 	attr_res->mode_change_neighbor = MAX(attr1->mode_change_neighbor, attr2->mode_change_neighbor);
 
@@ -846,6 +884,14 @@ static struct ast_format *evs_getjoint(const struct ast_format *format1, const s
 	if (0 < attr_res->mode_set) {
 		attr_res->mode_current = floor(log10(attr_res->mode_set) / log10(2));
 	}
+	/* one per call, for the CMR from its decoder to its encoder; not the one
+	 * of another call, when a format of that call was the starting point */
+	ao2_cleanup(attr_res->mailbox);
+	attr_res->mailbox = ao2_alloc_options(sizeof(*attr_res->mailbox), NULL,
+		AO2_ALLOC_OPT_LOCK_NOLOCK);
+	if (attr_res->mailbox) {
+		attr_res->mailbox->mode = EVS_NO_REQ;
+	}
 
 	return jointformat;
 }
@@ -855,7 +901,7 @@ static struct ast_format_interface evs_interface = {
 	.format_clone = evs_clone,
 	.format_cmp = evs_cmp,
 	.format_get_joint = evs_getjoint,
-	.format_attribute_set = NULL,
+	.format_attribute_set = evs_set,
 	.format_parse_sdp_fmtp = evs_parse_sdp_fmtp,
 	.format_generate_sdp_fmtp = evs_generate_sdp_fmtp,
 };